@@ -0,0 +1,533 @@
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "logger.h"
+#include "clock.h"
+#include "benchmark.h"
+#include "sunposition.h"
+#include "hue/hue.h"
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool Benchmark::run(const std::string& type) {
+	if(type == "sun") {
+		return runSun();
+	}
+	if(type == "dispatch") {
+		return runDispatch();
+	}
+	if(type == "config") {
+		return runConfig();
+	}
+	if(type == "startup") {
+		return runStartup();
+	}
+	if(type == "logging") {
+		return runLogging();
+	}
+
+	Logger::error() << "Unknown benchmark " << type << "\n";
+	return false;
+}
+
+bool Benchmark::runSun() {
+	static const size_t sites = 100;
+	static const size_t polarSites = 10;
+	static const size_t days = 365;
+	static const size_t rounds = 10;
+
+	const size_t count = sites * days;
+	std::vector<time_t> dates(count);
+	std::vector<double> lats(count), lngs(count);
+	std::vector<time_t> rises(count), sets(count);
+	std::vector<bool> crosses(count);
+
+	// Every site gets a whole year of dates, sites are spread over the inhabited latitudes. The last
+	// few are north and south of the polar circles, where the batch version clamps days without sunrise or sunset.
+	time_t start = time(NULL);
+	for(size_t s = 0; s < sites; s++) {
+		double lat = -55.0 + (rand() % 12000) / 100.0;
+		if(s >= sites - polarSites) {
+			lat = ((s % 2 == 0) ? 1 : -1) * (66.0 + (rand() % 1400) / 100.0);
+		}
+
+		double lng = -180.0 + (rand() % 36000) / 100.0;
+
+		for(size_t d = 0; d < days; d++) {
+			dates[s * days + d] = start + d * 60 * 60 * 24;
+			lats[s * days + d] = lat;
+			lngs[s * days + d] = lng;
+		}
+	}
+
+	uint64_t scalarStart = nowNs();
+	for(size_t r = 0; r < rounds; r++) {
+		for(size_t i = 0; i < count; i++) {
+			std::pair<time_t, time_t> times;
+			crosses[i] = SunPosition::getTimes(times, dates[i], lats[i], lngs[i]);
+
+			rises[i] = times.first;
+			sets[i] = times.second;
+		}
+	}
+	uint64_t scalarTime = nowNs() - scalarStart;
+
+	std::vector<time_t> batchRises(count), batchSets(count);
+
+	uint64_t batchStart = nowNs();
+	for(size_t r = 0; r < rounds; r++) {
+		SunPosition::getTimes(&dates[0], &lats[0], &lngs[0], count, &batchRises[0], &batchSets[0]);
+	}
+	uint64_t batchTime = nowNs() - batchStart;
+
+	// Without sunrise or sunset the batch version gives the whole day or nothing between them.
+	time_t maxDiff = 0;
+	size_t polar = 0, unclamped = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(!crosses[i]) {
+			time_t length = batchSets[i] - batchRises[i];
+			if(std::min(std::abs(length), std::abs(length - 60 * 60 * 24)) > 1) {
+				unclamped++;
+			}
+
+			polar++;
+			continue;
+		}
+
+		time_t riseDiff = (rises[i] > batchRises[i]) ? rises[i] - batchRises[i] : batchRises[i] - rises[i];
+		time_t setDiff = (sets[i] > batchSets[i]) ? sets[i] - batchSets[i] : batchSets[i] - sets[i];
+
+		maxDiff = std::max(maxDiff, std::max(riseDiff, setDiff));
+	}
+
+	Logger::info() << "Sun times for " << days << "x" << sites << " inputs (" << polarSites << " polar sites), " << rounds << " rounds\n";
+	Logger::info() << "scalar: " << (scalarTime / (rounds * count)) << " ns/input\n";
+	Logger::info() << "batch: " << (batchTime / (rounds * count)) << " ns/input\n";
+	Logger::info() << "speedup: " << ((double)scalarTime / batchTime) << "x, max difference " << maxDiff << "s\n";
+	Logger::info() << "polar: " << polar << " inputs without sunrise or sunset, " << unclamped << " not clamped\n";
+
+	return true;
+}
+
+bool Benchmark::runDispatch() {
+	static const size_t timeTasks = 4000;
+	static const size_t cronTasks = 500;
+	static const size_t intervalTasks = 500;
+	static const size_t lights = 50;
+
+	// Precise tasks get their own wakeups in between the minutes, like in the daemon.
+	static const time_t wakeInterval = 15;
+
+	static const char* const days[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+	HueConfig config("/dev/null");
+
+	HueConfigSection* hubSection = config.newSection("Hub");
+	hubSection->setValue("id", "benchmark");
+	hubSection->setValue("user", "benchmark");
+
+	for(size_t i = 0; i < timeTasks + cronTasks + intervalTasks; i++) {
+		std::ostringstream id, lightList, value;
+		id << "task" << i;
+		lightList << "light" << (rand() % lights) << ",light" << (rand() % lights);
+
+		std::string type = "time";
+		if(i >= timeTasks + cronTasks) {
+			type = "interval";
+		}
+
+		HueConfigSection* taskSection = config.newSection("Task");
+		taskSection->setValue("id", id.str());
+		taskSection->setValue("name", id.str());
+		taskSection->setValue("type", type);
+		taskSection->setValue("hub", "benchmark");
+		taskSection->setValue("lights", lightList.str());
+		taskSection->setValue("enabled", "true");
+
+		HueConfigSection* stateSection = config.newSection("Task " + id.str() + " State");
+		stateSection->setValue("state", "toggle");
+
+		HueConfigSection* triggerSection = config.newSection("Task " + id.str() + " Trigger");
+		if(i < timeTasks) {
+			value << (rand() % 24) << ":" << (rand() % 60);
+			triggerSection->setValue("method", "recurring");
+			triggerSection->setValue("time", value.str());
+			triggerSection->setValue("days", std::string(days[rand() % 7]) + "," + days[rand() % 7]);
+		} else if(i < timeTasks + cronTasks) {
+			value << (rand() % 60) << " */" << (2 + rand() % 6) << " * * mon-fri";
+			triggerSection->setValue("method", "cron");
+			triggerSection->setValue("cron", value.str());
+		} else {
+			value << (15 * (20 + rand() % 100));
+			triggerSection->setValue("interval", value.str());
+		}
+	}
+
+	LOGGER_LEVEL level = Logger::level();
+	Logger::setLevel(LOGGER_LEVEL_ERROR);
+
+	SimulatedTransport transport(config);
+	setTransport(&transport);
+
+	time_t start = time(NULL);
+	start -= start % (60 * 60 * 24);
+	Clock::setTime(start);
+
+	// Creating the device looks up every task type in the registry.
+	uint64_t createStart = nowNs();
+	HubDevice* device = new HubDevice("benchmark", "192.0.2.1", "Benchmark", config);
+	uint64_t createTime = nowNs() - createStart;
+
+	const std::vector<HueTask*>& tasks = device->tasks();
+
+	std::vector<HueTask*> preciseTasks;
+	for(std::vector<HueTask*>::const_iterator it = tasks.begin(); it != tasks.end(); ++it) {
+		if((*it)->precise()) {
+			preciseTasks.push_back(*it);
+		}
+	}
+
+	size_t ticks = 0, idleTicks = 0, wakes = 0, triggers = 0;
+	uint64_t tickTime = 0, idleTickTime = 0, wakeTime = 0;
+	size_t writesBefore = transport.writes();
+
+	for(time_t t = start; t < start + 60 * 60 * 24; t += wakeInterval) {
+		Clock::setTime(t);
+
+		bool minute = (t % 60) == 0;
+		const std::vector<HueTask*>& dispatched = minute ? tasks : preciseTasks;
+
+		size_t tickTriggers = 0;
+		uint64_t tickStart = nowNs();
+		for(std::vector<HueTask*>::const_iterator it = dispatched.begin(); it != dispatched.end(); ++it) {
+			bool error = false;
+			if(!minute && (*it)->nextTrigger() > t) {
+				continue;
+			}
+			if((*it)->execute(error)) {
+				tickTriggers++;
+			}
+		}
+		uint64_t elapsed = nowNs() - tickStart;
+
+		triggers += tickTriggers;
+		if(minute) {
+			ticks++;
+			tickTime += elapsed;
+
+			if(tickTriggers == 0) {
+				idleTicks++;
+				idleTickTime += elapsed;
+			}
+		} else {
+			wakes++;
+			wakeTime += elapsed;
+		}
+	}
+
+	size_t writes = transport.writes() - writesBefore;
+	size_t taskCount = tasks.size();
+
+	delete device;
+	setTransport(NULL);
+	Clock::reset();
+	Logger::setLevel(level);
+
+	Logger::info() << "Dispatch for " << taskCount << " tasks (" << preciseTasks.size() << " precise) over a day of ticks\n";
+	Logger::info() << "create: " << (createTime / std::max<size_t>(1, taskCount)) << " ns/task\n";
+	Logger::info() << "minute tick: " << (tickTime / std::max<size_t>(1, ticks)) << " ns/tick, "
+		<< (tickTime / std::max<size_t>(1, ticks * taskCount)) << " ns/task\n";
+	Logger::info() << "idle minute tick: " << (idleTickTime / std::max<size_t>(1, idleTicks)) << " ns/tick (" << idleTicks << " ticks)\n";
+	Logger::info() << "precise wake: " << (wakeTime / std::max<size_t>(1, wakes)) << " ns/wake\n";
+	Logger::info() << triggers << " triggers, " << writes << " light writes\n";
+
+	return true;
+}
+
+// How the config used to be parsed, each section was collected into a string and then read again.
+static size_t parseLineByLine(const std::string& path, std::vector<HueConfigSection*>& sections) {
+	std::ifstream file(path.c_str());
+	std::string section = "";
+	while(file.good()) {
+		std::string buf = "";
+		std::getline(file, buf);
+
+		bool haveSection = section.length() > 0;
+		if(buf.length() > 0 && ((!haveSection && buf[0] == '[') || (haveSection && buf[0] != '[' && buf[0] != '#'))) {
+			section += buf + '\n';
+		}
+
+		if((!file.good() || (haveSection && buf.length() > 0 && buf[0] == '[')) && section.size() > 0) {
+			std::istringstream iss(section);
+			std::string line;
+			std::getline(iss, line);
+
+			HueConfigSection* configSection = new HueConfigSection(line.substr(1, line.find(']') - 1));
+			while(std::getline(iss, line)) {
+				size_t pos = line.find('=');
+				if(line.length() > 0 && line[0] != '#' && pos != std::string::npos) {
+					configSection->setValue(line.substr(0, pos), line.substr(pos + 1));
+				}
+			}
+
+			sections.push_back(configSection);
+			section = file.good() ? buf + '\n' : "";
+		}
+	}
+
+	return sections.size();
+}
+
+// A hub and three sections per task, with comments and blank lines like a hand written file.
+static bool writeConfigFile(char* path, size_t tasks) {
+	int fd = mkstemp(path);
+	if(fd < 0) {
+		Logger::error() << "Could not create a temporary config file\n";
+		return false;
+	}
+	close(fd);
+
+	std::ofstream file(path);
+	file << "# Benchmark config\n[Hub]\nid=benchmark\nuser=benchmark\n\n";
+	for(size_t i = 0; i < tasks; i++) {
+		file << "[Task]\nid=task" << i << "\nname=Task number " << i << "\ntype=time\nhub=benchmark\n"
+			<< "lights=light" << (rand() % 50) << ",light" << (rand() % 50) << "\nenabled=true\n\n"
+			<< "[Task task" << i << " State]\n# Turned on in the morning\nstate=on\nbrightness=" << (rand() % 255) << "\n\n"
+			<< "[Task task" << i << " Trigger]\nmethod=recurring\ntime=" << (rand() % 24) << ":" << (rand() % 60) << "\ndays=mon,tue,wed\n\n";
+	}
+
+	return true;
+}
+
+static size_t fileSize(const std::string& path) {
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0) {
+		return 0;
+	}
+
+	return st.st_size;
+}
+
+bool Benchmark::runConfig() {
+	static const size_t tasks = 3333;
+	static const size_t rounds = 20;
+
+	char path[] = "/tmp/huelights-benchmark-XXXXXX";
+	if(!writeConfigFile(path, tasks)) {
+		return false;
+	}
+
+	// Only the text parser is compared.
+	HueConfig config(path);
+	config.setSnapshots(false);
+
+	uint64_t parseStart = nowNs();
+	for(size_t r = 0; r < rounds; r++) {
+		bool parseFailure = false;
+		config.parse(parseFailure);
+	}
+	uint64_t parseTime = nowNs() - parseStart;
+
+	std::vector<HueConfigSection*> sections;
+	uint64_t lineStart = nowNs();
+	for(size_t r = 0; r < rounds; r++) {
+		for(size_t i = 0; i < sections.size(); i++) {
+			delete sections[i];
+		}
+		sections.clear();
+
+		parseLineByLine(path, sections);
+	}
+	uint64_t lineTime = nowNs() - lineStart;
+
+	// Both have to come up with the same sections.
+	size_t mismatches = 0;
+	for(size_t i = 0; i < sections.size(); i++) {
+		const std::vector<HueConfigSection*>& parsed = config.getSections(sections[i]->name());
+		bool found = false;
+		for(std::vector<HueConfigSection*>::const_iterator it = parsed.begin(); it != parsed.end() && !found; ++it) {
+			found = std::equal(sections[i]->begin(), sections[i]->end(), (*it)->begin());
+		}
+
+		if(!found) {
+			mismatches++;
+		}
+	}
+
+	size_t sectionCount = sections.size();
+	for(size_t i = 0; i < sections.size(); i++) {
+		delete sections[i];
+	}
+
+	unlink(path);
+
+	Logger::info() << "Config with " << sectionCount << " sections, " << rounds << " rounds\n";
+	Logger::info() << "line by line: " << (lineTime / rounds / 1000) << " us/parse\n";
+	Logger::info() << "mapped: " << (parseTime / rounds / 1000) << " us/parse\n";
+	Logger::info() << "speedup: " << ((double)lineTime / parseTime) << "x, " << mismatches << " mismatched sections\n";
+
+	return true;
+}
+
+bool Benchmark::runStartup() {
+	static const size_t tasks = 3333;
+	static const size_t rounds = 20;
+
+	char path[] = "/tmp/huelights-benchmark-XXXXXX";
+	if(!writeConfigFile(path, tasks)) {
+		return false;
+	}
+
+	std::string snapshot = std::string(path) + ".snap";
+
+	// Every command starts with a new config. Without a snapshot, like the first start after an edit,
+	// the snapshot is written along the way.
+	uint64_t textTime = 0;
+	size_t sections = 0;
+	for(size_t r = 0; r < rounds; r++) {
+		unlink(snapshot.c_str());
+
+		HueConfig config(path);
+		bool parseFailure = false;
+
+		uint64_t start = nowNs();
+		config.parse(parseFailure);
+		textTime += nowNs() - start;
+
+		sections = config.getSections("Task").size() * 3 + 1;
+	}
+
+	uint64_t snapshotTime = 0;
+	size_t mismatches = 0;
+	for(size_t r = 0; r < rounds; r++) {
+		HueConfig config(path);
+		bool parseFailure = false;
+
+		uint64_t start = nowNs();
+		config.parse(parseFailure);
+		snapshotTime += nowNs() - start;
+
+		if(r == 0) {
+			HueConfig text(path);
+			text.setSnapshots(false);
+			text.parse(parseFailure);
+
+			const std::vector<HueConfigSection*>& expected = text.getSections("Task");
+			const std::vector<HueConfigSection*>& loaded = config.getSections("Task");
+			for(size_t i = 0; i < expected.size(); i++) {
+				if(i >= loaded.size() || expected[i]->hash() != loaded[i]->hash()
+					|| !std::equal(expected[i]->begin(), expected[i]->end(), loaded[i]->begin())) {
+					mismatches++;
+				}
+			}
+		}
+	}
+
+	// The daemon goes on to build the tasks of each hub, the other commands mostly don't.
+	LOGGER_LEVEL level = Logger::level();
+	Logger::setLevel(LOGGER_LEVEL_ERROR);
+
+	HueConfig config(path);
+	bool parseFailure = false;
+	config.parse(parseFailure);
+
+	SimulatedTransport transport(config);
+	setTransport(&transport);
+
+	uint64_t createStart = nowNs();
+	HubDevice* device = new HubDevice("benchmark", "192.0.2.1", "Benchmark", config);
+	uint64_t createTime = nowNs() - createStart;
+	size_t taskCount = device->tasks().size();
+
+	delete device;
+	setTransport(NULL);
+	Logger::setLevel(level);
+
+	size_t textSize = fileSize(path);
+	size_t snapshotSize = fileSize(snapshot);
+
+	unlink(snapshot.c_str());
+	unlink(path);
+
+	Logger::info() << "Config with " << sections << " sections, " << rounds << " rounds (" << textSize << " bytes, snapshot " << snapshotSize << " bytes)\n";
+	Logger::info() << "text, writing the snapshot: " << (textTime / rounds / 1000) << " us/load\n";
+	Logger::info() << "snapshot: " << (snapshotTime / rounds / 1000) << " us/load\n";
+	Logger::info() << "speedup: " << ((double)textTime / snapshotTime) << "x, " << mismatches << " mismatched sections\n";
+	Logger::info() << "daemon start adds " << (createTime / 1000) << " us to build " << taskCount << " tasks\n";
+
+	return true;
+}
+
+bool Benchmark::runLogging() {
+	static const size_t rounds = 1000000;
+
+	// The two debug lines of HueLight::write.
+	std::string name = "Living room";
+	std::string url = "http://192.0.2.1/api/0123456789abcdef/lights/12/state";
+
+	LOGGER_LEVEL level = Logger::level();
+
+	// Keeps the loops from being optimized away.
+	volatile size_t sink = 0;
+
+	uint64_t start = nowNs();
+	for(size_t i = 0; i < rounds; i++) {
+		sink += i;
+	}
+	uint64_t baseTime = nowNs() - start;
+
+	Logger::setLevel(LOGGER_LEVEL_INFO);
+
+	start = nowNs();
+	for(size_t i = 0; i < rounds; i++) {
+		sink += i;
+		LOG_DEBUG() << "Write '" << name << "'\n";
+		LOG_DEBUG() << "Writing state for '" << name << "' to '" << url << "'\n";
+	}
+	uint64_t macroTime = nowNs() - start;
+
+	start = nowNs();
+	for(size_t i = 0; i < rounds; i++) {
+		sink += i;
+		Logger::debug() << "Write '" << name << "'\n";
+		Logger::debug() << "Writing state for '" << name << "' to '" << url << "'\n";
+	}
+	uint64_t streamTime = nowNs() - start;
+
+	// Enabled, but written to /dev/null rather than the terminal.
+	std::ofstream null("/dev/null");
+	std::streambuf* out = std::cout.rdbuf(null.rdbuf());
+	Logger::setLevel(LOGGER_LEVEL_DEBUG);
+
+	size_t enabledRounds = rounds / 10;
+	start = nowNs();
+	for(size_t i = 0; i < enabledRounds; i++) {
+		sink += i;
+		LOG_DEBUG() << "Write '" << name << "'\n";
+		LOG_DEBUG() << "Writing state for '" << name << "' to '" << url << "'\n";
+	}
+	uint64_t enabledTime = nowNs() - start;
+
+	std::cout.rdbuf(out);
+	Logger::setLevel(level);
+
+	Logger::info() << "Debug logging of a light write, " << rounds << " rounds (" << (LOGGER_MIN_LEVEL > LOGGER_LEVEL_DEBUG ? "not built in" : "built in") << ")\n";
+	Logger::info() << "no logging: " << ((double)baseTime / rounds) << " ns/write\n";
+	Logger::info() << "disabled LOG_DEBUG(): " << ((double)macroTime / rounds) << " ns/write\n";
+	Logger::info() << "disabled Logger::debug(): " << ((double)streamTime / rounds) << " ns/write\n";
+	Logger::info() << "enabled: " << ((double)enabledTime / enabledRounds) << " ns/write\n";
+
+	return true;
+}
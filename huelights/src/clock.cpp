@@ -0,0 +1,4 @@
+#include "clock.h"
+
+bool Clock::sVirtual = false;
+time_t Clock::sTime = 0;
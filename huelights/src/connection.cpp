@@ -1,9 +1,16 @@
 #include <vector>
 #include <cstring>
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "connection.h"
 
+static Transport* sTransport = NULL;
+
+void setTransport(Transport* transport) {
+	sTransport = transport;
+}
+
 static size_t putBuffer(char *stream, size_t size, size_t nmemb, std::vector<char> *data)
 {
 	if(data == NULL) {
@@ -35,22 +42,56 @@ static int writer(char *data, size_t size, size_t nmemb,
 	return size * nmemb;
 }
 
+// Every thread keeps its curl handle, so that the connection to its hub stays open between requests.
+static pthread_key_t sHandleKey;
+
+static void releaseHandle(void* conn)
+{
+	curl_easy_cleanup(static_cast<CURL*>(conn));
+}
+
+static void globalInit()
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+	pthread_key_create(&sHandleKey, releaseHandle);
+}
+
 static bool init(CURL *&conn, const char *url, std::string* buffer, char* errorBuffer)
 {
+	static pthread_once_t globalInitOnce = PTHREAD_ONCE_INIT;
+
 	CURLcode code;
 
-	curl_global_init(CURL_GLOBAL_ALL);
-	conn = curl_easy_init();
+	// curl_global_init isn't thread safe, and requests are made from several hub threads.
+	pthread_once(&globalInitOnce, globalInit);
+	conn = static_cast<CURL*>(pthread_getspecific(sHandleKey));
 
-	if (conn == NULL)
+	if (conn != NULL)
 	{
-		fprintf(stderr, "Failed to create CURL connection\n");
+		// Resetting the options keeps the open connections of the handle.
+		curl_easy_reset(conn);
+	}
+	else
+	{
+		conn = curl_easy_init();
+
+		if (conn == NULL)
+		{
+			fprintf(stderr, "Failed to create CURL connection\n");
 
-		exit(EXIT_FAILURE);
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_setspecific(sHandleKey, conn);
 	}
 
 	curl_easy_setopt(conn, CURLOPT_SSL_VERIFYPEER, 0L);
 
+	// Don't let an unreachable hub stall its thread forever, signals can't be used for timeouts with threads.
+	curl_easy_setopt(conn, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(conn, CURLOPT_CONNECTTIMEOUT, 5L);
+	curl_easy_setopt(conn, CURLOPT_TIMEOUT, 15L);
+
 	code = curl_easy_setopt(conn, CURLOPT_ERRORBUFFER, errorBuffer);
 	if (code != CURLE_OK)
 	{
@@ -95,6 +136,10 @@ static bool init(CURL *&conn, const char *url, std::string* buffer, char* errorB
 }
 
 bool downloadJson(std::string url, json_object** output) {
+	if(sTransport != NULL) {
+		return sTransport->downloadJson(url, output);
+	}
+
 	CURL *conn = NULL;
 	char errorBuffer[CURL_ERROR_SIZE];
 	std::string buffer;
@@ -108,8 +153,6 @@ bool downloadJson(std::string url, json_object** output) {
 	// Retrieve content for the URL
 
 	CURLcode code = curl_easy_perform(conn);
-	curl_easy_cleanup(conn);
-	curl_global_cleanup();
 
 	if (code != CURLE_OK)
 	{
@@ -122,6 +165,10 @@ bool downloadJson(std::string url, json_object** output) {
 }
 
 bool postJson(std::string url, json_object* input, json_object** output) {
+	if(sTransport != NULL) {
+		return sTransport->postJson(url, input, output);
+	}
+
 	CURL *conn = NULL;
 	char errorBuffer[CURL_ERROR_SIZE];
 	std::string buffer;
@@ -137,8 +184,6 @@ bool postJson(std::string url, json_object* input, json_object** output) {
 	// Retrieve content for the URL
 
 	CURLcode code = curl_easy_perform(conn);
-	curl_easy_cleanup(conn);
-	curl_global_cleanup();
 
 	if (code != CURLE_OK)
 	{
@@ -151,6 +196,10 @@ bool postJson(std::string url, json_object* input, json_object** output) {
 }
 
 bool putJson(std::string url, json_object* input, json_object** output) {
+	if(sTransport != NULL) {
+		return sTransport->putJson(url, input, output);
+	}
+
 	CURL *conn = NULL;
 	char errorBuffer[CURL_ERROR_SIZE];
 	std::string buffer;
@@ -173,8 +222,36 @@ bool putJson(std::string url, json_object* input, json_object** output) {
 
 	// Retrieve content for the URL
 	CURLcode code = curl_easy_perform(conn);
-	curl_easy_cleanup(conn);
-	curl_global_cleanup();
+
+	if (code != CURLE_OK)
+	{
+		fprintf(stderr, "Failed to get url %d [%s]\n", code, errorBuffer);
+		return false;
+	}
+
+	*output = json_tokener_parse(buffer.c_str());
+	return *output != NULL;
+}
+
+bool deleteJson(std::string url, json_object** output) {
+	if(sTransport != NULL) {
+		return sTransport->deleteJson(url, output);
+	}
+
+	CURL *conn = NULL;
+	char errorBuffer[CURL_ERROR_SIZE];
+	std::string buffer;
+
+	if (!init(conn, url.c_str(), &buffer, &errorBuffer[0]))
+	{
+		fprintf(stderr, "Connection initializion failed\n");
+		return false;
+	}
+
+	curl_easy_setopt(conn, CURLOPT_CUSTOMREQUEST, "DELETE");
+
+	// Retrieve content for the URL
+	CURLcode code = curl_easy_perform(conn);
 
 	if (code != CURLE_OK)
 	{
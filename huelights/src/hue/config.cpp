@@ -1,212 +1,897 @@
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <cctype>
+#include <climits>
+#include <algorithm>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logger.h"
+#include "utils.h"
 #include "hue/config.h"
 
 HueConfig::HueConfig(const std::string &path)
-	: mPath(path)
+	: mPath(path),
+	mGeneration(0),
+	mSnapshots(true),
+	mSourceHash(0),
+	mSourceSize(0),
+	mHasSource(false)
 {
-
+	pthread_rwlock_init(&mLock, NULL);
+	pthread_mutex_init(&mIndexLock, NULL);
 }
 
 HueConfig::~HueConfig() {
-	for(size_t i = 0; i < mSections.size(); i++) {
-		delete mSections[i];
-	}
+	clearSections();
 
-	mSections.clear();
+	pthread_mutex_destroy(&mIndexLock);
+	pthread_rwlock_destroy(&mLock);
 }
 
-HueConfigSection* HueConfig::getSection(const std::string& name, std::string key, std::string value) const {
-	for(size_t i = 0; i < mSections.size(); i++) {
-		if(mSections[i]->name() != name) {
-			continue;
-		}
+void HueConfig::readLock() const {
+	pthread_rwlock_rdlock(&mLock);
+}
 
-		if(key.size() == 0 || mSections[i]->hasKey(key, value)) {
-			return mSections[i];
-		}
+void HueConfig::writeLock() const {
+	pthread_rwlock_wrlock(&mLock);
+}
+
+void HueConfig::unlock() const {
+	pthread_rwlock_unlock(&mLock);
+}
+
+HueConfigSection* HueConfig::getSection(const std::string& name, const std::string& key, const std::string& value) const {
+	const SectionList& sections = getSections(name, key, value);
+	return sections.empty() ? NULL : sections.front();
+}
+
+const std::vector<HueConfigSection*>& HueConfig::getSections(const std::string& name, const std::string& key, const std::string& value) const {
+	static const SectionList empty;
+
+	std::map<std::string, NameIndex>::const_iterator nameIt = mIndex.find(name);
+	if(nameIt == mIndex.end()) {
+		return empty;
 	}
 
-	return NULL;
+	if(key.empty()) {
+		return nameIt->second.sections;
+	}
+
+	const KeyIndex& index = keyIndex(nameIt->second, key);
+	if(value.empty()) {
+		return index.sections;
+	}
+
+	std::map<std::string, SectionList>::const_iterator valueIt = index.values.find(value);
+	if(valueIt == index.values.end()) {
+		return empty;
+	}
+
+	return valueIt->second;
 }
 
-const std::vector<HueConfigSection*> HueConfig::getSections(const std::string& name, std::string key, std::string value) const {
-	std::vector<HueConfigSection *> ret;
-	for(std::vector<HueConfigSection*>::const_iterator it = mSections.begin(); it != mSections.end(); ++it) {
-		if((*it)->name() != name) {
-			continue;
-		}
+const HueConfig::KeyIndex& HueConfig::keyIndex(const NameIndex& nameIndex, const std::string& key) const {
+	pthread_mutex_lock(&mIndexLock);
+
+	// Existing entries stay where they are when others are added, so the reference outlives the lock.
+	std::map<std::string, KeyIndex>& keys = const_cast<NameIndex&>(nameIndex).keys;
+	std::map<std::string, KeyIndex>::iterator keyIt = keys.find(key);
+	if(keyIt == keys.end()) {
+		keyIt = keys.insert(std::make_pair(key, KeyIndex())).first;
 
-		if(key.size() == 0 || (*it)->hasKey(key, value)) {
-			ret.push_back(*it);
+		for(SectionList::const_iterator it = nameIndex.sections.begin(); it != nameIndex.sections.end(); ++it) {
+			HueConfigSection::KeyMap::const_iterator valueIt = (*it)->mValues.find(key);
+			if(valueIt != (*it)->mValues.end()) {
+				keyIt->second.sections.push_back(*it);
+				keyIt->second.values[valueIt->second.text()].push_back(*it);
+			}
 		}
 	}
 
-	return ret;
+	pthread_mutex_unlock(&mIndexLock);
+	return keyIt->second;
 }
 
 HueConfigSection* HueConfig::newSection(const std::string& name) {
 	HueConfigSection* section = new HueConfigSection(name);
+	section->mConfig = this;
+	section->mOrder = mSections.size();
+	mGeneration++;
+
 	mSections.push_back(section);
+	mIndex[name].sections.push_back(section);
 	return section;
 }
 
-bool HueConfig::parse(bool& parseFailure) {
-	bool ret = false;
+void HueConfig::indexValue(HueConfigSection* section, const std::string& key, const std::string& value) {
+	std::map<std::string, KeyIndex>& keys = mIndex[section->name()].keys;
+	if(keys.empty()) {
+		return;
+	}
+
+	std::map<std::string, KeyIndex>::iterator keyIt = keys.find(key);
+	if(keyIt == keys.end()) {
+		return;
+	}
+
+	insertSorted(keyIt->second.sections, section);
+	insertSorted(keyIt->second.values[value], section);
+}
+
+void HueConfig::unindexValue(HueConfigSection* section, const std::string& key, const std::string& value) {
+	std::map<std::string, KeyIndex>& keys = mIndex[section->name()].keys;
+	std::map<std::string, KeyIndex>::iterator keyIt = keys.find(key);
+	if(keyIt == keys.end()) {
+		return;
+	}
+
+	KeyIndex& keyIndex = keyIt->second;
+	erase(keyIndex.sections, section);
 
-	if(mSections.size() > 0) {
-		for(size_t i = 0; i < mSections.size(); i++) {
-			delete mSections[i];
+	std::map<std::string, SectionList>::iterator valueIt = keyIndex.values.find(value);
+	if(valueIt != keyIndex.values.end()) {
+		erase(valueIt->second, section);
+		if(valueIt->second.empty()) {
+			keyIndex.values.erase(valueIt);
 		}
+	}
+}
+
+static bool sectionBefore(const HueConfigSection* a, const HueConfigSection* b) {
+	return a->order() < b->order();
+}
+
+void HueConfig::insertSorted(SectionList& sections, HueConfigSection* section) {
+	// Sections are mostly indexed in order, so this is usually an append.
+	if(sections.empty() || sections.back()->order() < section->order()) {
+		sections.push_back(section);
+		return;
+	}
+
+	sections.insert(std::lower_bound(sections.begin(), sections.end(), section, sectionBefore), section);
+}
+
+void HueConfig::erase(SectionList& sections, HueConfigSection* section) {
+	SectionList::iterator it = std::lower_bound(sections.begin(), sections.end(), section, sectionBefore);
+	if(it != sections.end() && *it == section) {
+		sections.erase(it);
+	}
+}
+
+// A read-only mapping of a whole regular file. An empty file can't be mapped, its data is NULL.
+struct MappedFile {
+	const char* data;
+	size_t size;
+	int mode;
+};
 
-		mSections.clear();
+static bool mapFile(const std::string& path, MappedFile& file) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
 	}
 
-	std::ifstream file(mPath.c_str());
-	if(!file.good()) {
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
 		return false;
 	}
-	std::string section = "";
-	while(file.good()) {
-		std::string buf = "";
-		std::getline(file, buf);
 
-		bool haveSection = section.length() > 0;
-		if(buf.length() > 0 && ((!haveSection && buf[0] == '[') || (haveSection && buf[0] != '[' && buf[0] != '#'))) {
-			section += buf + '\n';
+	file.data = NULL;
+	file.size = st.st_size;
+	file.mode = st.st_mode & 07777;
+	if(file.size > 0) {
+		void* data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			close(fd);
+			return false;
 		}
 
-		if(!file.good() || (haveSection && buf.length() > 0 && buf[0] == '[')) {
-			if(section.size() > 0) {
-				HueConfigSection* configSection = new HueConfigSection();
-				if(!configSection->parse(section)) {
-					ret = false;
-					break;
-				}
+		file.data = static_cast<const char*>(data);
+	}
 
-				mSections.push_back(configSection);
-				if(file.good()) {
-					section = buf + '\n';
-				} else {
-					section = "";
-				}
+	close(fd);
+	return true;
+}
+
+static void unmapFile(MappedFile& file) {
+	if(file.data != NULL) {
+		munmap(const_cast<char*>(file.data), file.size);
+		file.data = NULL;
+	}
+}
 
-				ret = true;
+// Written next to it and renamed over the old one, so that a reader never sees half a file.
+static bool writeFileAtomically(const std::string& path, const std::string& contents, int mode, bool sync) {
+	std::string tmpPath = path + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if(fd < 0) {
+		return false;
+	}
+
+	// The mode given to open is limited by the umask.
+	fchmod(fd, mode);
+
+	size_t written = 0;
+	while(written < contents.size()) {
+		ssize_t ret = ::write(fd, contents.data() + written, contents.size() - written);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
 			}
+
+			break;
 		}
+
+		written += ret;
 	}
 
-	file.close();
+	// Without the sync, a power cut right after the rename can leave an empty file behind.
+	bool ret = written == contents.size() && (!sync || fsync(fd) == 0);
+	if(close(fd) != 0) {
+		ret = false;
+	}
 
-	if(!ret && mSections.size() > 0) {
-		for(size_t i = 0; i < mSections.size(); i++) {
-			delete mSections[i];
-		}
+	if(!ret || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool HueConfig::parse(bool& parseFailure) {
+	clearSections();
+
+	MappedFile file;
+	if(!mapFile(mPath, file)) {
+		return false;
+	}
+
+	uint64_t hash = hashBytes(file.data, file.size);
 
-		mSections.clear();
+	bool ret = mSnapshots && loadSnapshot(hash, file.size);
+	if(!ret) {
+		ret = parseBuffer(file.data, file.size);
+		if(ret && mSnapshots) {
+			writeSnapshot(hash, file.size);
+		}
 	}
 
+	unmapFile(file);
+
 	if(!ret) {
+		clearSections();
 		parseFailure = true;
+		return false;
 	}
 
-	return ret;
+	mSourceHash = hash;
+	mSourceSize = file.size;
+	mHasSource = true;
+	return true;
 }
 
-bool HueConfig::write() {
-	std::ofstream file(mPath.c_str(), std::ios::trunc);
-	if(!file.good()) {
+bool HueConfig::parseBuffer(const char* data, size_t size) {
+	HueConfigSection* section = NULL;
+
+	const char* end = data + size;
+	size_t lineNumber = 0;
+	for(const char* line = data; line < end; ) {
+		const char* lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+		if(lineEnd == NULL) {
+			lineEnd = end;
+		}
+
+		const char* next = lineEnd + ((lineEnd < end) ? 1 : 0);
+		size_t length = lineEnd - line;
+		lineNumber++;
+
+		if(length == 0) {
+			line = next;
+			continue;
+		}
+
+		if(line[0] == '[') {
+			const char* close = static_cast<const char*>(memchr(line, ']', length));
+			if(close == NULL) {
+				parseError(lineNumber, "missing ']' after the section name");
+				return false;
+			}
+			if(close == line + 1) {
+				parseError(lineNumber, "empty section name");
+				return false;
+			}
+
+			if(section != NULL) {
+				section->mSourceLength = (line - data) - section->mSourceOffset;
+			}
+
+			section = newSection(std::string(line + 1, close));
+			section->mSourceOffset = line - data;
+		} else if(section != NULL && line[0] != '#') {
+			// Anything before the first section is ignored.
+			const char* equals = static_cast<const char*>(memchr(line, '=', length));
+			if(equals == NULL) {
+				parseError(lineNumber, "expected key=value");
+				return false;
+			}
+			if(equals == line) {
+				parseError(lineNumber, "empty key");
+				return false;
+			}
+
+			section->addValue(line, equals - line, equals + 1, lineEnd - equals - 1);
+		}
+
+		line = next;
+	}
+
+	if(section != NULL) {
+		section->mSourceLength = size - section->mSourceOffset;
+	}
+
+	return mSections.size() > 0;
+}
+
+// Native byte order, the snapshot is only read on the machine that wrote it.
+struct SnapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash;
+	uint64_t sourceSize;
+	uint32_t sections;
+	uint32_t reserved;
+};
+
+static const uint32_t sSnapshotMagic = 0x534c4548; // "HELS"
+static const uint32_t sSnapshotVersion = 2;
+
+// Lengths are stored 7 bits at a time with the high bit set on all but the last byte, strings as their
+// length followed by the bytes. Nothing is padded.
+static bool readLength(const char*& ptr, const char* end, uint32_t& length) {
+	length = 0;
+	for(int shift = 0; shift < 32; shift += 7) {
+		if(ptr >= end) {
+			return false;
+		}
+
+		unsigned char byte = *ptr++;
+		length |= (uint32_t)(byte & 0x7F) << shift;
+		if((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool readString(const char*& ptr, const char* end, const char*& str, uint32_t& length) {
+	if(!readLength(ptr, end, length) || (uint64_t)(end - ptr) < length) {
+		return false;
+	}
+
+	str = ptr;
+	ptr += length;
+	return true;
+}
+
+static void appendLength(std::string& out, uint32_t length) {
+	while(length >= 0x80) {
+		out.push_back((char)((length & 0x7F) | 0x80));
+		length >>= 7;
+	}
+
+	out.push_back((char)length);
+}
+
+static void appendString(std::string& out, const std::string& str) {
+	appendLength(out, str.size());
+	out.append(str);
+}
+
+std::string HueConfig::snapshotPath() const {
+	return mPath + ".snap";
+}
+
+bool HueConfig::loadSnapshot(uint64_t sourceHash, uint64_t sourceSize) {
+	int fd = open(snapshotPath().c_str(), O_RDONLY);
+	if(fd < 0) {
 		return false;
 	}
 
-	for(std::vector<HueConfigSection*>::const_iterator itSection = mSections.begin(); itSection != mSections.end(); ++itSection) {
-		file << "[" << (*itSection)->name() << "]\n";
-		for(HueConfigSection::KeyMap::const_iterator it = (*itSection)->begin(); it != (*itSection)->end(); ++it) {
-			file << (*it).first << "=" << (*it).second << "\n";
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+		close(fd);
+		return false;
+	}
+
+	size_t size = st.st_size;
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED) {
+		return false;
+	}
+
+	const char* ptr = static_cast<const char*>(data);
+	const char* end = ptr + size;
+
+	SnapshotHeader header;
+	memcpy(&header, ptr, sizeof(header));
+	ptr += sizeof(header);
+
+	bool ret = header.magic == sSnapshotMagic && header.version == sSnapshotVersion
+		&& header.sourceHash == sourceHash && header.sourceSize == sourceSize && header.sections > 0;
+
+	for(uint32_t i = 0; ret && i < header.sections; i++) {
+		const char* name;
+		uint32_t nameLength, values;
+		uint64_t hash;
+		if(!readString(ptr, end, name, nameLength) || end - ptr < (ptrdiff_t)sizeof(hash)) {
+			ret = false;
+			break;
 		}
 
-		file << "\n";
+		memcpy(&hash, ptr, sizeof(hash));
+		ptr += sizeof(hash);
+
+		uint32_t sourceOffset, sourceLength;
+		if(!readLength(ptr, end, sourceOffset) || !readLength(ptr, end, sourceLength) || !readLength(ptr, end, values)) {
+			ret = false;
+			break;
+		}
+
+		// The values were written in the order of the map and nothing has been indexed yet,
+		// so they go straight in at the end, and the hash doesn't have to be calculated again.
+		HueConfigSection* section = newSection(std::string(name, nameLength));
+		for(uint32_t v = 0; v < values; v++) {
+			const char* key;
+			const char* value;
+			uint32_t keyLength, valueLength;
+			if(!readString(ptr, end, key, keyLength) || !readString(ptr, end, value, valueLength)) {
+				ret = false;
+				break;
+			}
+
+			section->mValues.insert(section->mValues.end(), std::make_pair(std::string(key, keyLength), HueConfigValue(std::string(value, valueLength))));
+		}
+
+		section->mHash = hash;
+		section->mSourceOffset = sourceOffset;
+		section->mSourceLength = sourceLength;
 	}
 
-	file.close();
+	munmap(data, size);
+
+	// A snapshot that doesn't add up is as good as none.
+	if(!ret || ptr != end) {
+		if(header.magic == sSnapshotMagic && header.version == sSnapshotVersion && header.sourceHash == sourceHash) {
+			Logger::warning() << "Ignoring damaged config snapshot " << snapshotPath() << "\n";
+		}
+
+		clearSections();
+		return false;
+	}
 
 	return true;
 }
 
-HueConfigSection::HueConfigSection(std::string name)
-	: mName(name)
-{
+void HueConfig::writeSnapshot(uint64_t sourceHash, uint64_t sourceSize) const {
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = sSnapshotMagic;
+	header.version = sSnapshotVersion;
+	header.sourceHash = sourceHash;
+	header.sourceSize = sourceSize;
+	header.sections = mSections.size();
+
+	std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+	for(std::vector<HueConfigSection*>::const_iterator it = mSections.begin(); it != mSections.end(); ++it) {
+		appendString(out, (*it)->name());
+		out.append(reinterpret_cast<const char*>(&(*it)->mHash), sizeof((*it)->mHash));
+		appendLength(out, (*it)->mSourceOffset);
+		appendLength(out, (*it)->mSourceLength);
+		appendLength(out, (*it)->mValues.size());
+		for(HueConfigSection::KeyMap::const_iterator valueIt = (*it)->begin(); valueIt != (*it)->end(); ++valueIt) {
+			appendString(out, valueIt->first);
+			appendString(out, valueIt->second.text());
+		}
+	}
 
+	// Only a cache, it isn't worth a sync.
+	if(!writeFileAtomically(snapshotPath(), out, 0644, false)) {
+		LOG_DEBUG() << "Can't write config snapshot " << snapshotPath() << ": " << strerror(errno) << "\n";
+	}
 }
 
-bool HueConfigSection::hasKey(const std::string &key, std::string value) const {
-	std::map<std::string, std::string>::const_iterator it = mValues.find(key);
-	if(it != mValues.end()) {
-		if(value.length() > 0 && it->second != value) {
-			return false;
+void HueConfig::parseError(size_t line, const char* message) const {
+	Logger::error() << mPath << ":" << line << ": " << message << "\n";
+}
+
+void HueConfig::clearSections() {
+	for(size_t i = 0; i < mSections.size(); i++) {
+		delete mSections[i];
+	}
+
+	mSections.clear();
+	mIndex.clear();
+	mGeneration++;
+	mHasSource = false;
+}
+
+bool HueConfig::write() {
+	size_t changed = 0;
+	for(std::vector<HueConfigSection*>::const_iterator it = mSections.begin(); it != mSections.end(); ++it) {
+		if((*it)->mDirty || (*it)->mSourceLength == 0) {
+			changed++;
 		}
+	}
 
+	// The file already says all of it, leave the flash alone.
+	if(changed == 0 && mHasSource) {
 		return true;
 	}
 
-	return false;
+	// Unchanged sections are copied from the file as they are, as long as it is still the file that was parsed.
+	MappedFile source;
+	source.data = NULL;
+	source.mode = 0644;
+
+	bool incremental = false;
+	if(mapFile(mPath, source)) {
+		incremental = mHasSource && source.size == mSourceSize && hashBytes(source.data, source.size) == mSourceHash;
+		if(mHasSource && !incremental) {
+			Logger::warning() << mPath << " has changed since it was read, writing it out in full\n";
+		}
+	}
+
+	std::string out;
+	if(incremental && !mSections.empty() && mSections[0]->mSourceLength > 0) {
+		// Comments before the first section.
+		out.append(source.data, mSections[0]->mSourceOffset);
+	}
+
+	HueConfigSection* previous = NULL;
+	for(std::vector<HueConfigSection*>::const_iterator it = mSections.begin(); it != mSections.end(); ++it) {
+		HueConfigSection* section = *it;
+		size_t offset = out.size();
+
+		if(incremental && section->mSourceLength > 0) {
+			const char* data = source.data + section->mSourceOffset;
+			if(section->mDirty) {
+				writeSection(out, *section, data, section->mSourceLength);
+			} else {
+				out.append(data, section->mSourceLength);
+			}
+		} else {
+			// The file may not end in a newline, it goes with the section before.
+			if(!out.empty() && out[out.size() - 1] != '\n') {
+				out += '\n';
+				if(previous != NULL) {
+					previous->mSourceLength++;
+				}
+			}
+
+			offset = out.size();
+			out += "[" + section->name() + "]\n";
+			for(HueConfigSection::KeyMap::const_iterator valueIt = section->begin(); valueIt != section->end(); ++valueIt) {
+				out += valueIt->first + "=" + valueIt->second.text() + "\n";
+			}
+
+			out += "\n";
+		}
+
+		section->mSourceOffset = offset;
+		section->mSourceLength = out.size() - offset;
+		previous = section;
+	}
+
+	int mode = source.mode;
+	unmapFile(source);
+
+	if(!writeFileAtomically(mPath, out, mode, true)) {
+		Logger::error() << "Could not write " << mPath << ": " << strerror(errno) << "\n";
+		return false;
+	}
+
+	for(std::vector<HueConfigSection*>::const_iterator it = mSections.begin(); it != mSections.end(); ++it) {
+		(*it)->mDirty = false;
+	}
+
+	mSourceHash = hashBytes(out.data(), out.size());
+	mSourceSize = out.size();
+	mHasSource = true;
+
+	LOG_DEBUG() << "Wrote " << changed << " of " << mSections.size() << " sections to " << mPath << "\n";
+
+	if(mSnapshots) {
+		writeSnapshot(mSourceHash, mSourceSize);
+	}
+
+	return true;
 }
 
-std::string HueConfigSection::value(const std::string &key, std::string def) const {
-	std::map<std::string, std::string>::const_iterator it = mValues.find(key);
-	if(it != mValues.end()) {
-		return it->second;
+void HueConfig::writeSection(std::string& out, const HueConfigSection& section, const char* data, size_t size) const {
+	std::set<std::string> seen;
+
+	// Keys that weren't in the file go after the last value, ahead of blank lines and comments that lead into the next section.
+	size_t insertAt = std::string::npos;
+
+	const char* end = data + size;
+	for(const char* line = data; line < end; ) {
+		const char* lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+		if(lineEnd == NULL) {
+			lineEnd = end;
+		}
+
+		const char* next = lineEnd + ((lineEnd < end) ? 1 : 0);
+		const char* equals = static_cast<const char*>(memchr(line, '=', lineEnd - line));
+
+		if(insertAt != std::string::npos && lineEnd > line && line[0] != '#' && equals != NULL && equals != line) {
+			std::string key(line, equals);
+			const HueConfigValue* value = section.find(key);
+
+			// Later lines with the same key were ignored when parsing, so they stay as they are.
+			if(seen.insert(key).second && value != NULL && value->text() != std::string(equals + 1, lineEnd)) {
+				out += key + "=" + value->text() + "\n";
+			} else {
+				out.append(line, lineEnd);
+				out += '\n';
+			}
+
+			insertAt = out.size();
+		} else {
+			out.append(line, next);
+			if(insertAt == std::string::npos) {
+				// The line with the section name.
+				if(next == lineEnd) {
+					out += '\n';
+				}
+
+				insertAt = out.size();
+			}
+		}
+
+		line = next;
+	}
+
+	std::string added;
+	for(HueConfigSection::KeyMap::const_iterator it = section.begin(); it != section.end(); ++it) {
+		if(seen.count(it->first) == 0) {
+			added += it->first + "=" + it->second.text() + "\n";
+		}
 	}
 
-	return def;
+	out.insert(insertAt, added);
+}
+
+// Values are summed up, so that a change only has to take out the old value and add the new one.
+static uint64_t valueHash(const std::string& key, const std::string& value) {
+	uint64_t h = hashBytes(key.data(), key.size());
+	h = hashBytes("=", 1, h);
+	return hashBytes(value.data(), value.size(), h);
+}
+
+HueConfigSection::HueConfigSection(std::string name)
+	: mName(name),
+	mHash(hashBytes(name.data(), name.size())),
+	mConfig(NULL),
+	mOrder(0),
+	mSourceOffset(0),
+	mSourceLength(0),
+	mDirty(false)
+{
+
+}
+
+bool HueConfigSection::hasKey(const std::string &key, const std::string& value) const {
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return false;
+	}
+
+	return value.length() == 0 || found->text() == value;
+}
+
+const HueConfigValue* HueConfigSection::find(const std::string& key) const {
+	KeyMap::const_iterator it = mValues.find(key);
+	if(it == mValues.end()) {
+		return NULL;
+	}
+
+	return &it->second;
+}
+
+const std::string& HueConfigSection::value(const std::string &key) const {
+	static const std::string empty;
+	return value(key, empty);
+}
+
+const std::string& HueConfigSection::value(const std::string &key, const std::string& def) const {
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return def;
+	}
+
+	return found->text();
+}
+
+void HueConfigSection::invalidValue(const std::string& key, const HueConfigValue& value, const char* expected) const {
+	Logger::error() << ((mConfig != NULL) ? mConfig->path() + ": " : "") << "[" << mName << "] " << key << "=" << value.text()
+		<< " is not " << expected << ", using the default\n";
+}
+
+bool HueConfigSection::boolValue(const std::string& key, bool def) const {
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return def;
+	}
+	if(!found->is(HueConfigValue::TypeBool)) {
+		invalidValue(key, *found, "true or false");
+		return def;
+	}
+
+	return found->toBool();
+}
+
+int HueConfigSection::intValue(const std::string& key, int def) const {
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return def;
+	}
+	if(!found->is(HueConfigValue::TypeInt)) {
+		invalidValue(key, *found, "a whole number");
+		return def;
+	}
+
+	return found->toInt();
+}
+
+double HueConfigSection::doubleValue(const std::string& key, double def) const {
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return def;
+	}
+	if(!found->is(HueConfigValue::TypeDouble)) {
+		invalidValue(key, *found, "a number");
+		return def;
+	}
+
+	return found->toDouble();
+}
+
+const std::vector<std::string>& HueConfigSection::listValue(const std::string& key) const {
+	static const std::vector<std::string> empty;
+
+	const HueConfigValue* found = find(key);
+	if(found == NULL) {
+		return empty;
+	}
+
+	// Readers only share a section while holding the read lock, writers replace the value as a whole.
+	if(mConfig != NULL) {
+		pthread_mutex_lock(&mConfig->mIndexLock);
+	}
+
+	if(!found->mListed) {
+		commaListToVector(found->text(), found->mList);
+		found->mListed = true;
+	}
+
+	if(mConfig != NULL) {
+		pthread_mutex_unlock(&mConfig->mIndexLock);
+	}
+
+	return found->mList;
 }
 
 void HueConfigSection::setValue(const std::string& key, const std::string& value) {
-	std::map<std::string, std::string>::iterator it = mValues.find(key);
+	KeyMap::iterator it = mValues.find(key);
+	if(it != mValues.end() && it->second.text() == value) {
+		return;
+	}
+
+	mDirty = true;
+	if(mConfig != NULL) {
+		mConfig->mGeneration++;
+	}
+
 	if(it != mValues.end()) {
-		it->second = value;
+		if(mConfig != NULL) {
+			mConfig->unindexValue(this, key, it->second.text());
+			mConfig->indexValue(this, key, value);
+		}
+
+		mHash -= valueHash(key, it->second.text());
+		mHash += valueHash(key, value);
+		it->second = HueConfigValue(value);
 		return;
 	}
 
-	mValues.insert(std::make_pair(key, value));
+	mValues.insert(std::make_pair(key, HueConfigValue(value)));
+	mHash += valueHash(key, value);
+	if(mConfig != NULL) {
+		mConfig->indexValue(this, key, value);
+	}
 }
 
-bool HueConfigSection::parse(const std::string& content) {
-	std::istringstream iss(content);
+void HueConfigSection::addValue(const char* key, size_t keyLength, const char* value, size_t valueLength) {
+	std::pair<KeyMap::iterator, bool> inserted = mValues.insert(std::make_pair(std::string(key, keyLength), HueConfigValue(std::string(value, valueLength))));
+	if(!inserted.second) {
+		return;
+	}
 
-	std::string line;
-	if(std::getline(iss, line)) {
-		size_t pos = line.find(']');
-		if(pos == std::string::npos) {
-			return false;
-		}
+	const std::string& text = inserted.first->second.text();
+	mHash += valueHash(inserted.first->first, text);
+	if(mConfig != NULL) {
+		mConfig->mGeneration++;
+		mConfig->indexValue(this, inserted.first->first, text);
+	}
+}
 
-		mName = line.substr(1, pos - 1);
-		if(mName.size() == 0) {
-			return false;
-		}
+// Surrounding blanks are allowed around numbers, like atoi and strtod used to.
+static const char* skipBlanks(const char* str) {
+	while(*str == ' ' || *str == '\t' || *str == '\r') {
+		str++;
 	}
 
-	while(std::getline(iss, line)) {
-		if(line.length() > 0 && line[0] == '#') {
-			continue;
-		}
+	return str;
+}
 
-		size_t pos = line.find('=');
-		if(line.size() > 0 && pos == std::string::npos) {
-			return false;
-		} else if(pos == std::string::npos) {
-			continue;
+HueConfigValue::HueConfigValue(const std::string& text)
+	: mText(text),
+	mNumber(0),
+	mTypes(0),
+	mListed(false)
+{
+	if(mText == "true" || mText == "false") {
+		mTypes = TypeBool;
+		mNumber = (mText == "true") ? 1 : 0;
+		return;
+	}
+
+	const char* begin = skipBlanks(mText.c_str());
+	if(!isdigit((unsigned char)*begin) && *begin != '-' && *begin != '+' && *begin != '.') {
+		return;
+	}
+
+	// Most numbers are small integers, which are read without strtod.
+	const char* ptr = begin + ((*begin == '-' || *begin == '+') ? 1 : 0);
+	long long integer = 0;
+	const char* digits = ptr;
+	while(isdigit((unsigned char)*ptr) && ptr - digits < 12) {
+		integer = integer * 10 + (*ptr - '0');
+		ptr++;
+	}
+
+	if(ptr != digits && *skipBlanks(ptr) == 0) {
+		if(*begin == '-') {
+			integer = -integer;
 		}
 
-		if(pos == 0) {
-			return false;
+		mTypes = TypeDouble;
+		mNumber = integer;
+		if(integer >= INT_MIN && integer <= INT_MAX) {
+			mTypes |= TypeInt;
 		}
 
-		mValues.insert(std::make_pair(line.substr(0, pos), line.substr(pos + 1)));
+		return;
 	}
 
-	return true;
+	char* end;
+	errno = 0;
+	double number = strtod(begin, &end);
+	if(end == begin || *skipBlanks(end) != 0 || errno == ERANGE) {
+		return;
+	}
+
+	mTypes = TypeDouble;
+	mNumber = number;
 }
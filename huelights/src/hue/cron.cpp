@@ -0,0 +1,266 @@
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "hue/cron.h"
+#include "utils.h"
+
+static const char* const sMonthNames[] = {"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec", NULL};
+static const char* const sWeekdayNames[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat", NULL};
+
+// How far ahead next() looks, enough for the 29th of february on a given weekday.
+static const int32_t sSearchDays = 366 * 28;
+
+HueCronExpression::HueCronExpression()
+	: mExpression("* * * * *"),
+	mMinutes((1ULL << 60) - 1),
+	mHours((1U << 24) - 1),
+	mDays(((1U << 31) - 1) << 1),
+	mMonths((1U << 12) - 1),
+	mWeekdays(0x7F),
+	mDayOr(false)
+{
+
+}
+
+static bool parseNumber(const std::string& str, int min, const char* const* names, int& value) {
+	if(names != NULL) {
+		for(int i = 0; names[i] != NULL; i++) {
+			if(str == names[i]) {
+				value = i + min;
+				return true;
+			}
+		}
+	}
+
+	if(str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+		return false;
+	}
+
+	value = atoi(str.c_str());
+	return true;
+}
+
+bool HueCronExpression::parseField(const std::string& field, int min, int max, const char* const* names, uint64_t& mask) {
+	mask = 0;
+
+	std::vector<std::string> items;
+	commaListToVector(field, items);
+	if(items.empty()) {
+		return false;
+	}
+
+	for(std::vector<std::string>::const_iterator it = items.begin(); it != items.end(); ++it) {
+		std::string range = *it;
+
+		int step = 1;
+		size_t slash = range.find('/');
+		if(slash != std::string::npos) {
+			if(!parseNumber(range.substr(slash + 1), 0, NULL, step) || step < 1) {
+				return false;
+			}
+
+			range = range.substr(0, slash);
+		}
+
+		int first = min, last = max;
+		if(range != "*") {
+			size_t dash = range.find('-');
+			if(!parseNumber(range.substr(0, dash), min, names, first)) {
+				return false;
+			}
+
+			if(dash != std::string::npos) {
+				if(!parseNumber(range.substr(dash + 1), min, names, last)) {
+					return false;
+				}
+			} else if(slash == std::string::npos) {
+				last = first;
+			}
+		}
+
+		if(first < min || last > max || first > last) {
+			return false;
+		}
+
+		for(int i = first; i <= last; i += step) {
+			mask |= 1ULL << i;
+		}
+	}
+
+	return true;
+}
+
+bool HueCronExpression::parse(const std::string& expr) {
+	std::vector<std::string> fields;
+	commaListToVector(expr, fields, ' ');
+	if(fields.size() != 5) {
+		return false;
+	}
+
+	uint64_t minutes, hours, days, months, weekdays;
+	if(!parseField(fields[0], 0, 59, NULL, minutes)
+		|| !parseField(fields[1], 0, 23, NULL, hours)
+		|| !parseField(fields[2], 1, 31, NULL, days)
+		|| !parseField(fields[3], 1, 12, sMonthNames, months)
+		|| !parseField(fields[4], 0, 7, sWeekdayNames, weekdays)) {
+		return false;
+	}
+
+	mExpression = expr;
+	mMinutes = minutes;
+	mHours = hours;
+	mDays = days;
+	mMonths = months >> 1;
+
+	// Both 0 and 7 are sunday.
+	mWeekdays = (weekdays | (weekdays >> 7)) & 0x7F;
+
+	mDayOr = fields[2][0] != '*' && fields[4][0] != '*';
+	return true;
+}
+
+bool HueCronExpression::parseExclusions(const std::string& dates) {
+	std::vector<std::string> items;
+	commaListToVector(dates, items);
+
+	std::vector<int32_t> excluded;
+	for(std::vector<std::string>::const_iterator it = items.begin(); it != items.end(); ++it) {
+		int year, month, mday;
+		char end;
+		if(sscanf(it->c_str(), "%d-%d-%d%c", &year, &month, &mday, &end) != 3 || month < 1 || month > 12 || mday < 1 || mday > 31) {
+			return false;
+		}
+
+		excluded.push_back(dayNumber(year, month, mday));
+	}
+
+	std::sort(excluded.begin(), excluded.end());
+	mExcluded.swap(excluded);
+	return true;
+}
+
+void HueCronExpression::setDaily(int hour, int minute, uint8_t weekdays) {
+	std::ostringstream expr;
+	expr << minute << " " << hour << " * * *";
+
+	mExpression = expr.str();
+	mMinutes = 1ULL << minute;
+	mHours = 1U << hour;
+	mDays = ((1U << 31) - 1) << 1;
+	mMonths = (1U << 12) - 1;
+	mWeekdays = weekdays & 0x7F;
+	mDayOr = false;
+}
+
+std::string HueCronExpression::exclusions() const {
+	std::ostringstream ret;
+	for(std::vector<int32_t>::const_iterator it = mExcluded.begin(); it != mExcluded.end(); ++it) {
+		int year, month, mday;
+		civilDate(*it, year, month, mday);
+
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%04d-%02d-%02d", year, month, mday);
+		ret << ((it == mExcluded.begin()) ? "" : ",") << buf;
+	}
+
+	return ret.str();
+}
+
+int32_t HueCronExpression::dayNumber(int year, int month, int mday) {
+	// Shift the year to start in march, so that the leap day is the last one.
+	year -= month <= 2;
+	int32_t era = (year >= 0 ? year : year - 399) / 400;
+	int32_t yoe = year - era * 400;
+	int32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+	int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+void HueCronExpression::civilDate(int32_t day, int& year, int& month, int& mday) {
+	day += 719468;
+	int32_t era = (day >= 0 ? day : day - 146096) / 146097;
+	int32_t doe = day - era * 146097;
+	int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int32_t mp = (5 * doy + 2) / 153;
+
+	mday = doy - (153 * mp + 2) / 5 + 1;
+	month = mp < 10 ? mp + 3 : mp - 9;
+	year = yoe + era * 400 + (month <= 2);
+}
+
+bool HueCronExpression::matchesDay(int32_t day) const {
+	int year, month, mday;
+	civilDate(day, year, month, mday);
+
+	if((mMonths & (1U << (month - 1))) == 0) {
+		return false;
+	}
+
+	bool dayMatch = (mDays & (1U << mday)) != 0;
+	bool weekdayMatch = (mWeekdays & (1U << weekday(day))) != 0;
+	if(mDayOr ? !(dayMatch || weekdayMatch) : !(dayMatch && weekdayMatch)) {
+		return false;
+	}
+
+	return !std::binary_search(mExcluded.begin(), mExcluded.end(), day);
+}
+
+time_t HueCronExpression::next(time_t after) const {
+	struct tm tm;
+	localtime_r(&after, &tm);
+
+	int32_t day = dayNumber(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+	int hour = tm.tm_hour;
+	int minute = tm.tm_min + 1;
+	if(minute > 59) {
+		minute = 0;
+		hour++;
+	}
+
+	for(int32_t end = day + sSearchDays; day < end; day++, hour = minute = 0) {
+		if(hour > 23 || !matchesDay(day)) {
+			continue;
+		}
+
+		// The first matching hour, and the first matching minute in it.
+		uint32_t hours = mHours & (~0U << hour);
+		while(hours != 0) {
+			int h = __builtin_ctz(hours);
+			uint64_t minutes = mMinutes & (~0ULL << ((h == hour) ? minute : 0));
+			if(minutes != 0) {
+				int year, month, mday;
+				civilDate(day, year, month, mday);
+
+				struct tm triggerTm;
+				memset(&triggerTm, 0, sizeof(triggerTm));
+				triggerTm.tm_year = year - 1900;
+				triggerTm.tm_mon = month - 1;
+				triggerTm.tm_mday = mday;
+				triggerTm.tm_hour = h;
+				triggerTm.tm_min = __builtin_ctzll(minutes);
+				triggerTm.tm_isdst = -1;
+
+				// Only fails to be ahead when DST ends and the hour repeats.
+				time_t t = mktime(&triggerTm);
+				if(t > after) {
+					return t;
+				}
+
+				minute = triggerTm.tm_min + 1;
+				hour = h;
+				if(minute > 59) {
+					hours &= hours - 1;
+					minute = 0;
+				}
+				continue;
+			}
+
+			hours &= hours - 1;
+		}
+	}
+
+	return -1;
+}
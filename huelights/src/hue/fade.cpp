@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <sstream>
+#include <stdint.h>
+#include "logger.h"
+#include "connection.h"
+#include "hue/fade.h"
+#include "hue/hub.h"
+#include "hue/light.h"
+
+// Brightness for 256 evenly spaced steps of perceived lightness (CIE 1976 L*), 0 is off.
+static const uint8_t sPerceptual[256] = {
+	  0,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,
+	  2,   2,   2,   2,   2,   2,   2,   3,   3,   3,   3,   3,   3,   3,   3,   4,
+	  4,   4,   4,   4,   4,   5,   5,   5,   5,   5,   6,   6,   6,   6,   6,   7,
+	  7,   7,   7,   8,   8,   8,   8,   9,   9,   9,   9,  10,  10,  10,  11,  11,
+	 11,  12,  12,  12,  13,  13,  13,  14,  14,  14,  15,  15,  16,  16,  16,  17,
+	 17,  18,  18,  19,  19,  20,  20,  20,  21,  21,  22,  22,  23,  24,  24,  25,
+	 25,  26,  26,  27,  27,  28,  29,  29,  30,  30,  31,  32,  32,  33,  34,  34,
+	 35,  36,  36,  37,  38,  39,  39,  40,  41,  42,  42,  43,  44,  45,  46,  46,
+	 47,  48,  49,  50,  51,  52,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,
+	 62,  63,  64,  65,  66,  67,  68,  69,  70,  71,  73,  74,  75,  76,  77,  78,
+	 79,  81,  82,  83,  84,  86,  87,  88,  89,  91,  92,  93,  95,  96,  97,  99,
+	100, 101, 103, 104, 106, 107, 109, 110, 111, 113, 114, 116, 118, 119, 121, 122,
+	124, 125, 127, 129, 130, 132, 134, 135, 137, 139, 140, 142, 144, 146, 148, 149,
+	151, 153, 155, 157, 159, 160, 162, 164, 166, 168, 170, 172, 174, 176, 178, 180,
+	182, 184, 186, 188, 191, 193, 195, 197, 199, 201, 204, 206, 208, 210, 213, 215,
+	217, 220, 222, 224, 227, 229, 232, 234, 236, 239, 241, 244, 246, 249, 251, 254,
+};
+
+// The longest transition the bridge accepts, in steps of 100ms.
+static const int sMaxTransition = 65535;
+
+// Steps are never closer than this, in seconds. The bridge smooths out the rest.
+static const time_t sMinInterval = 2;
+
+HueFadeEngine::HueFadeEngine(int budget)
+	: mBudget(std::max(1, budget)),
+	mGroupSecond(-1)
+{
+
+}
+
+void HueFadeEngine::setBudget(int budget) {
+	mBudget = std::max(1, budget);
+}
+
+bool HueFadeEngine::curveFromString(const std::string& str, Curve& curve) {
+	if(str == "linear") {
+		curve = CurveLinear;
+	} else if(str == "perceptual") {
+		curve = CurvePerceptual;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+const char* HueFadeEngine::curveToString(Curve curve) {
+	return (curve == CurveLinear) ? "linear" : "perceptual";
+}
+
+void HueFadeEngine::start(const std::vector<HueLight*>& lights, int from, int to, time_t start, int duration, Curve curve) {
+	for(std::vector<HueLight*>::const_iterator it = lights.begin(); it != lights.end(); ++it) {
+		Fade fade;
+		fade.from = from;
+		if(fade.from < 0) {
+			fade.from = (*it)->state()->on() ? std::max(1, (*it)->state()->brightness()) : 0;
+		}
+
+		fade.to = to;
+		fade.start = start;
+		fade.end = start + std::max(0, duration);
+		fade.curve = curve;
+		fade.nextAt = start;
+		fade.sent = -1;
+
+		mFades[(*it)->id()] = fade;
+	}
+
+	Logger::info() << "Fading " << lights.size() << " lights to " << to << " over " << duration << "s, " << mFades.size() << " fades running\n";
+}
+
+void HueFadeEngine::cancel(const std::string& lightID) {
+	mFades.erase(lightID);
+}
+
+time_t HueFadeEngine::next() const {
+	time_t ret = -1;
+	for(std::map<std::string, Fade>::const_iterator it = mFades.begin(); it != mFades.end(); ++it) {
+		if(ret < 0 || it->second.nextAt < ret) {
+			ret = it->second.nextAt;
+		}
+	}
+
+	return ret;
+}
+
+int HueFadeEngine::toLevel(int brightness) {
+	return std::lower_bound(sPerceptual, sPerceptual + 256, std::min(254, brightness)) - sPerceptual;
+}
+
+int HueFadeEngine::brightnessAt(const Fade& fade, time_t t) const {
+	if(t >= fade.end) {
+		return fade.to;
+	}
+	if(t <= fade.start) {
+		return fade.from;
+	}
+
+	int64_t elapsed = t - fade.start;
+	int64_t duration = fade.end - fade.start;
+
+	if(fade.curve == CurveLinear) {
+		return fade.from + (fade.to - fade.from) * elapsed / duration;
+	}
+
+	// Interpolate in perceived lightness, so that the low end doesn't rush by.
+	int from = toLevel(fade.from);
+	int to = toLevel(fade.to);
+	return sPerceptual[from + (to - from) * elapsed / duration];
+}
+
+time_t HueFadeEngine::interval() const {
+	// Every running fade sends at most one command per interval.
+	time_t ret = (mFades.size() + mBudget - 1) / mBudget;
+	return std::max(sMinInterval, ret);
+}
+
+bool HueFadeEngine::stepsBefore(const FadeIt& a, const FadeIt& b) {
+	const Fade& x = a->second;
+	const Fade& y = b->second;
+	if(x.from != y.from) {
+		return x.from < y.from;
+	}
+	if(x.to != y.to) {
+		return x.to < y.to;
+	}
+	if(x.start != y.start) {
+		return x.start < y.start;
+	}
+	if(x.end != y.end) {
+		return x.end < y.end;
+	}
+	if(x.curve != y.curve) {
+		return x.curve < y.curve;
+	}
+
+	return x.sent < y.sent;
+}
+
+size_t HueFadeEngine::step(const HubDevice& device, time_t now) {
+	time_t stepInterval = interval();
+
+	std::vector<FadeIt> due;
+	FadeIt it = mFades.begin();
+	while(it != mFades.end()) {
+		if(it->second.nextAt > now) {
+			++it;
+			continue;
+		}
+
+		if(device.light(it->first) == NULL) {
+			mFades.erase(it++);
+			continue;
+		}
+
+		due.push_back(it);
+		++it;
+	}
+
+	// Fades that started together with the same from, to and curve send the same commands, as long as
+	// none of their writes failed. Those are next to each other after this, in the order of their lights.
+	std::stable_sort(due.begin(), due.end(), stepsBefore);
+
+	size_t sent = 0;
+	size_t first = 0;
+	while(first < due.size()) {
+		size_t last = first + 1;
+		while(last < due.size() && !stepsBefore(due[first], due[last])) {
+			last++;
+		}
+
+		sent += stepTogether(device, now, stepInterval, std::vector<FadeIt>(due.begin() + first, due.begin() + last));
+		first = last;
+	}
+
+	removeGroups(device, now);
+	return sent;
+}
+
+size_t HueFadeEngine::stepTogether(const HubDevice& device, time_t now, time_t stepInterval, const std::vector<FadeIt>& fades) {
+	const Fade fade = fades.front()->second;
+
+	// Linear fades that fit in a single transition are left to the bridge entirely.
+	time_t target = std::min(fade.end, now + stepInterval);
+	if(fade.curve == CurveLinear && fade.sent < 0 && (fade.end - now) * 10 <= sMaxTransition) {
+		target = fade.end;
+	}
+
+	int brightness = brightnessAt(fade, target);
+	bool send = brightness != fade.sent || target >= fade.end;
+
+	// The light only goes off at the very end of a fade to 0.
+	HueLightState command;
+	command.setOn(brightness > 0 || target < fade.end);
+	if(command.on()) {
+		command.setBrightness(std::max(1, brightness));
+	}
+	command.setTransitionTime((target - now) * 10);
+
+	bool grouped = false;
+	size_t sent = 0;
+	if(send && fades.size() > 1 && writeGroup(device, fades, command, now)) {
+		grouped = true;
+		sent++;
+	}
+
+	for(std::vector<FadeIt>::const_iterator it = fades.begin(); it != fades.end(); ++it) {
+		Fade& lightFade = (*it)->second;
+		HueLight* light = device.light((*it)->first);
+
+		if(send) {
+			// Out of budget for this second, the rest goes out with the next one.
+			if(!grouped && device.commandsLeft(now) == 0) {
+				lightFade.nextAt = now + 1;
+				continue;
+			}
+
+			command.copyTo(light->newState());
+			if(grouped) {
+				light->written();
+				lightFade.sent = brightness;
+			} else {
+				if(light->write(device)) {
+					lightFade.sent = brightness;
+				} else {
+					Logger::warning() << "Fade step for light " << (*it)->first << " failed\n";
+				}
+
+				sent++;
+			}
+		}
+
+		if(target >= lightFade.end) {
+			mFades.erase(*it);
+			continue;
+		}
+
+		lightFade.nextAt = now + stepInterval;
+	}
+
+	return sent;
+}
+
+bool HueFadeEngine::writeGroup(const HubDevice& device, const std::vector<FadeIt>& fades, const HueLightState& state, time_t now) {
+	// The bridge only takes about one group command a second, any others go to the lights one by one.
+	if(now == mGroupSecond) {
+		return false;
+	}
+
+	std::vector<std::string> ids;
+	for(std::vector<FadeIt>::const_iterator it = fades.begin(); it != fades.end(); ++it) {
+		ids.push_back((*it)->first);
+	}
+
+	std::string id = group(device, ids, now);
+	if(id.empty() || device.commandsLeft(now) == 0) {
+		return false;
+	}
+
+	mGroupSecond = now;
+	device.countCommands(now);
+
+	json_object* obj = state.toJson();
+	json_object* output;
+	bool ret = putJson("http://" + device.ip() + "/api/" + device.user() + "/groups/" + id + "/action", obj, &output);
+	json_object_put(obj);
+
+	if(!ret) {
+		Logger::warning() << "Could not write fade step to group " << id << " on hub " << device.id() << "\n";
+		return false;
+	}
+
+	for(int i = 0; i < json_object_array_length(output); i++) {
+		json_object* successObj;
+		if(!json_object_object_get_ex(json_object_array_get_idx(output, i), "success", &successObj)) {
+			ret = false;
+		}
+	}
+
+	json_object_put(output);
+	return ret;
+}
+
+std::string HueFadeEngine::group(const HubDevice& device, const std::vector<std::string>& ids, time_t now) {
+	std::map<std::vector<std::string>, std::string>::const_iterator it = mGroups.find(ids);
+	if(it != mGroups.end()) {
+		return it->second;
+	}
+
+	// Creating it and the first step take two commands, without them it is tried again on the next step.
+	if(device.commandsLeft(now) < 2) {
+		return "";
+	}
+
+	json_object* lightsObj = json_object_new_array();
+	for(std::vector<std::string>::const_iterator idIt = ids.begin(); idIt != ids.end(); ++idIt) {
+		std::ostringstream index;
+		index << device.light(*idIt)->index();
+		json_object_array_add(lightsObj, json_object_new_string(index.str().c_str()));
+	}
+
+	json_object* inputObj = json_object_new_object();
+	json_object_object_add(inputObj, "name", json_object_new_string("huelights fade"));
+	json_object_object_add(inputObj, "type", json_object_new_string("LightGroup"));
+	json_object_object_add(inputObj, "lights", lightsObj);
+
+	device.countCommands(now);
+
+	json_object* output;
+	bool ret = postJson("http://" + device.ip() + "/api/" + device.user() + "/groups", inputObj, &output);
+	json_object_put(inputObj);
+
+	if(!ret) {
+		Logger::warning() << "Could not create a group for " << ids.size() << " fading lights on hub " << device.id() << "\n";
+		return "";
+	}
+
+	// A refused group isn't asked for again while these lights fade together.
+	std::string& id = mGroups[ids];
+
+	json_object* successObj;
+	json_object* idObj;
+	if(json_object_array_length(output) == 1
+		&& json_object_object_get_ex(json_object_array_get_idx(output, 0), "success", &successObj)
+		&& json_object_object_get_ex(successObj, "id", &idObj)) {
+		id = json_object_get_string(idObj);
+		LOG_DEBUG() << "Created group " << id << " for " << ids.size() << " fading lights on hub " << device.id() << "\n";
+	} else {
+		Logger::warning() << "Hub " << device.id() << " refused a group for " << ids.size() << " fading lights\n";
+	}
+
+	json_object_put(output);
+	return id;
+}
+
+void HueFadeEngine::removeGroups(const HubDevice& device, time_t now) {
+	std::map<std::vector<std::string>, std::string>::iterator it = mGroups.begin();
+	while(it != mGroups.end()) {
+		// Kept for as long as all of its lights still fade together.
+		const std::vector<std::string>& ids = it->first;
+		FadeIt firstFade = mFades.find(ids.front());
+
+		bool together = firstFade != mFades.end();
+		for(std::vector<std::string>::const_iterator idIt = ids.begin() + 1; together && idIt != ids.end(); ++idIt) {
+			FadeIt fade = mFades.find(*idIt);
+			together = fade != mFades.end() && !stepsBefore(firstFade, fade) && !stepsBefore(fade, firstFade);
+		}
+
+		if(together) {
+			++it;
+			continue;
+		}
+
+		if(!it->second.empty()) {
+			device.countCommands(now);
+
+			json_object* output;
+			if(deleteJson("http://" + device.ip() + "/api/" + device.user() + "/groups/" + it->second, &output)) {
+				json_object_put(output);
+			} else {
+				Logger::warning() << "Could not delete group " << it->second << " on hub " << device.id() << "\n";
+			}
+		}
+
+		mGroups.erase(it++);
+	}
+}
@@ -1,10 +1,16 @@
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <sstream>
+#include <algorithm>
+#include <map>
+#include <set>
 #include "logger.h"
+#include "clock.h"
 #include "hue/hub.h"
 #include "hue/light.h"
 #include "hue/task.h"
+#include "hue/fade.h"
 #include "connection.h"
 
 HubDevice::HubDevice(const std::string &id, const std::string &ip, const std::string &name, HueConfig& config)
@@ -12,14 +18,31 @@ HubDevice::HubDevice(const std::string &id, const std::string &ip, const std::st
 	mID(id),
 	mIp(ip),
 	mName(name),
-	mUser("")
+	mUser(""),
+	mBudget(10),
+	mSpread(30),
+	mWarmup(5),
+	mRefresh(600),
+	mReconcile(300),
+	mOffload(false),
+	mVerify(3600),
+	mLastRefresh(-1),
+	mBudgetSecond(-1),
+	mBudgetUsed(0),
+	mConfigGeneration(0),
+	mStatsStart(Clock::now()),
+	mLightsBytes(0),
+	mFullRefreshes(0),
+	mSkippedRefreshes(0),
+	mLightRefreshes(0),
+	mLightBytes(0),
+	mFades(new HueFadeEngine())
 {
-	HueConfigSection* configSection = mConfig.getSection("Hub", "id", id);
-	if(configSection != NULL) {
-		mUser = configSection->value("user");
-	}
+	loadSettings();
 
 	updateLights();
+
+	mConfigGeneration = configGeneration();
 	updateTasks();
 }
 
@@ -31,6 +54,8 @@ HubDevice::~HubDevice() {
 	for(std::vector<HueTask*>::const_iterator it = mTasks.begin(); it != mTasks.end(); ++it) {
 		delete *it;
 	}
+
+	delete mFades;
 }
 
 HueLight* HubDevice::light(const std::string& id) const {
@@ -43,6 +68,17 @@ HueLight* HubDevice::light(const std::string& id) const {
 	return NULL;
 }
 
+const std::vector<HueTask*>& HubDevice::lightTasks(const std::string& id) const {
+	static const std::vector<HueTask*> empty;
+
+	std::map<std::string, std::vector<HueTask*> >::const_iterator it = mLightTasks.find(id);
+	if(it == mLightTasks.end()) {
+		return empty;
+	}
+
+	return it->second;
+}
+
 HueTask* HubDevice::task(const std::string& id) const {
 	for(std::vector<HueTask*>::const_iterator it = mTasks.begin(); it != mTasks.end(); ++it) {
 		if(*(*it) == id) {
@@ -91,6 +127,7 @@ bool HubDevice::authorize(bool& retry) {
 	json_object_put(inputObj);
 
 	if(ret) {
+		HueConfigLock lock(mConfig, true);
 		HueConfigSection* section = mConfig.getSection("Hub", "id", mID);
 		if(section == NULL) {
 			section = mConfig.newSection("Hub");
@@ -109,22 +146,62 @@ bool HubDevice::update(const std::string &id, const std::string &ip, const std::
 	mIp = ip;
 	mName = name;
 
-	HueConfigSection* configSection = mConfig.getSection("Hub", "id", id);
-	if(configSection != NULL) {
-		mUser = configSection->value("user");
-	}
+	loadSettings();
 
-	if(!updateLights()) {
-		return false;
+	time_t now = Clock::now();
+	logRefreshStats(now);
+
+	if(mLights.empty() || mLastRefresh < 0 || now < mLastRefresh || now - mLastRefresh >= refreshInterval()) {
+		if(!updateLights()) {
+			return false;
+		}
+	} else {
+		mSkippedRefreshes++;
 	}
 
-	if(!updateTasks()) {
+	updateConfig();
+	return true;
+}
+
+unsigned long HubDevice::configGeneration() const {
+	HueConfigLock lock(mConfig);
+	return mConfig.generation();
+}
+
+bool HubDevice::updateConfig() {
+	unsigned long generation = configGeneration();
+	if(generation == mConfigGeneration) {
 		return false;
 	}
 
+	loadSettings();
+	updateTasks();
+
+	mConfigGeneration = generation;
 	return true;
 }
 
+void HubDevice::loadSettings() {
+	HueConfigLock lock(mConfig);
+	HueConfigSection* configSection = mConfig.getSection("Hub", "id", mID);
+	if(configSection == NULL) {
+		return;
+	}
+
+	mUser = configSection->value("user");
+
+	// The spread has to stay within the minute, or tasks would no longer be due when their turn comes.
+	mBudget = std::max(1, configSection->intValue("budget", 10));
+	mSpread = std::min(50, std::max(0, configSection->intValue("spread", 30)));
+	mWarmup = std::min(30, std::max(0, configSection->intValue("warmup", 5)));
+	mRefresh = std::max(60, configSection->intValue("refresh", 600));
+	mReconcile = std::max(0, configSection->intValue("reconcile", 300));
+	mOffload = configSection->boolValue("offload", false);
+	mVerify = std::max(60, configSection->intValue("verify", 3600));
+
+	mFades->setBudget(mBudget);
+}
+
 bool HubDevice::updateLights() {
 	if(!isAuthorized()) {
 		return false;
@@ -134,6 +211,11 @@ bool HubDevice::updateLights() {
 
 	json_object* lightsObj;
 	if(downloadJson("http://" + mIp + "/api/" + mUser + "/lights", &lightsObj)) {
+		// The size of the response, near enough.
+		mLightsBytes = strlen(json_object_to_json_string(lightsObj));
+		mFullRefreshes++;
+		mLastRefresh = Clock::now();
+
 		json_object_object_foreach(lightsObj, key, val) {
 			json_object *idObj;
 			if(!json_object_object_get_ex(val, "uniqueid", &idObj)) {
@@ -163,6 +245,12 @@ bool HubDevice::updateLights() {
 			}
 
 			mLights.push_back(light);
+
+			// Tasks that were waiting for it.
+			const std::vector<HueTask*>& tasks = lightTasks(id);
+			for(std::vector<HueTask*>::const_iterator it = tasks.begin(); it != tasks.end(); ++it) {
+				(*it)->addLight(light);
+			}
 		}
 
 		json_object_put(lightsObj);
@@ -179,6 +267,17 @@ bool HubDevice::updateLights() {
 		}
 
 		if(!found) {
+			mFades->cancel(mLights[i]->id());
+
+			// The tasks go on with their other lights, and get this one back if it returns.
+			const std::vector<HueTask*>& tasks = lightTasks(mLights[i]->id());
+			for(std::vector<HueTask*>::const_iterator it = tasks.begin(); it != tasks.end(); ++it) {
+				(*it)->removeLight(mLights[i]);
+			}
+
+			Logger::warning() << "Light " << mLights[i]->id() << " (" << mLights[i]->name() << ") is gone from hub " << mID
+				<< ", " << tasks.size() << " tasks go on without it\n";
+
 			delete mLights[i];
 			mLights.erase(mLights.begin() + i);
 			i--;
@@ -188,21 +287,89 @@ bool HubDevice::updateLights() {
 	return true;
 }
 
+size_t HubDevice::commandsLeft(time_t now) const {
+	if(now != mBudgetSecond) {
+		return mBudget;
+	}
+
+	return (mBudgetUsed < (size_t)mBudget) ? mBudget - mBudgetUsed : 0;
+}
+
+void HubDevice::countCommands(time_t now, size_t commands) const {
+	if(now != mBudgetSecond) {
+		mBudgetSecond = now;
+		mBudgetUsed = 0;
+	}
+
+	mBudgetUsed += commands;
+}
+
+bool HubDevice::refreshLight(HueLight* light) {
+	size_t bytes = 0;
+	if(!light->refresh(*this, &bytes)) {
+		return false;
+	}
+
+	mLightRefreshes++;
+	mLightBytes += bytes;
+	return true;
+}
+
+void HubDevice::logRefreshStats(time_t now) {
+	if(now >= mStatsStart && now - mStatsStart < 60 * 60) {
+		return;
+	}
+
+	if(mSkippedRefreshes > 0) {
+		long requests = (long)mSkippedRefreshes - (long)mLightRefreshes;
+		long bytes = (long)(mSkippedRefreshes * mLightsBytes) - (long)mLightBytes;
+
+		Logger::info() << "Hub " << mID << " refreshed all lights " << mFullRefreshes << " times and single lights " << mLightRefreshes
+			<< " times in the last hour, saving " << requests << " requests and " << bytes << " bytes\n";
+	}
+
+	mStatsStart = now;
+	mFullRefreshes = 0;
+	mSkippedRefreshes = 0;
+	mLightRefreshes = 0;
+	mLightBytes = 0;
+}
+
 bool HubDevice::updateTasks() {
+	HueConfigLock lock(mConfig);
+
+	size_t rebuilt = 0;
+	size_t reused = 0;
+	size_t created = 0;
+	size_t removed = 0;
+
+	std::map<std::string, HueTask*> existing;
+	for(std::vector<HueTask*>::const_iterator it = mTasks.begin(); it != mTasks.end(); ++it) {
+		existing.insert(std::make_pair((*it)->id(), *it));
+	}
+
 	// Look for new tasks.
-	const std::vector<HueConfigSection*> sections = mConfig.getSections("Task", "hub", mID);
+	std::set<std::string> ids;
+	const std::vector<HueConfigSection*>& sections = mConfig.getSections("Task", "hub", mID);
 	for(std::vector<HueConfigSection*>::const_iterator it = sections.begin(); it != sections.end(); ++it) {
-		bool shouldAdd = true;
-		for(std::vector<HueTask*>::const_iterator taskIt = mTasks.begin(); taskIt != mTasks.end(); ++taskIt) {
-			if(*(*taskIt) == (*it)->value("id")) {
-				(*taskIt)->update(mConfig, *(*it));
+		const std::string id = (*it)->value("id");
 
-				shouldAdd = false;
-				break;
-			}
+		// Tasks are looked up by id, so only the first section with an id is used.
+		if(!ids.insert(id).second) {
+			Logger::warning() << "Task (" << id << ") is defined more than once on hub " << mID << ", using the first one\n";
+			continue;
 		}
 
-		if(!shouldAdd) {
+		std::map<std::string, HueTask*>::const_iterator taskIt = existing.find(id);
+		if(taskIt != existing.end()) {
+			// Updating recalculates the trigger, which is skipped for tasks that haven't changed.
+			if(taskIt->second->fingerprint() == HueTask::configFingerprint(mConfig, *(*it))) {
+				reused++;
+				continue;
+			}
+
+			taskIt->second->update(mConfig, *(*it));
+			rebuilt++;
 			continue;
 		}
 
@@ -216,25 +383,31 @@ bool HubDevice::updateTasks() {
 		}
 
 		mTasks.push_back(task);
+		created++;
 	}
 
 	// Look for removed tasks.
 	for(uint32_t i = 0; i < mTasks.size(); i++) {
-		bool found = false;
-		for(std::vector<HueConfigSection*>::const_iterator it = sections.begin(); it != sections.end(); ++it) {
-			if(*mTasks.at(i) == (*it)->value("id")) {
-				found = true;
-			}
-		}
-
 		// Couldn't find it in the config file, remove it!
-		if(!found) {
+		if(ids.count(mTasks[i]->id()) == 0) {
 			delete mTasks[i];
 			mTasks.erase(mTasks.begin() + i);
+			removed++;
 			i--;
 		}
 	}
 
+	// The lights of tasks only change along with their config.
+	mLightTasks.clear();
+	for(std::vector<HueTask*>::const_iterator it = mTasks.begin(); it != mTasks.end(); ++it) {
+		for(std::vector<std::string>::const_iterator lightIt = (*it)->lightIDs().begin(); lightIt != (*it)->lightIDs().end(); ++lightIt) {
+			mLightTasks[*lightIt].push_back(*it);
+		}
+	}
+
+	Logger::info() << "Tasks on hub " << mID << ": " << rebuilt << " updated, " << reused << " unchanged, "
+		<< created << " added, " << removed << " removed\n";
+
 	return true;
 }
 
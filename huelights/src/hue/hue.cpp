@@ -4,88 +4,89 @@
 #include "hue/hue.h"
 #include "connection.h"
 
-HubDevice* Hue::getHubDevice(const std::string& deviceID, HueConfig& config) {
-	HubDevice* device = NULL;
-
+bool Hue::discoverHubs(std::vector<std::pair<std::string, std::string> >& hubs) {
 	json_object* pnpObj;
-	if(downloadJson("https://www.meethue.com/api/nupnp", &pnpObj)) {
-		for(int i = 0; i < json_object_array_length(pnpObj); i++) {
-			json_object *idObj, *ipObj;
-			json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "id", &idObj);
-			json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "internalipaddress", &ipObj);
+	if(!downloadJson("https://www.meethue.com/api/nupnp", &pnpObj)) {
+		return false;
+	}
 
-			std::string id = json_object_get_string(idObj);
-			std::string ip = json_object_get_string(ipObj);
+	for(int i = 0; i < json_object_array_length(pnpObj); i++) {
+		json_object *idObj, *ipObj;
+		json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "id", &idObj);
+		json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "internalipaddress", &ipObj);
 
-			if(id != deviceID) {
-				continue;
-			}
+		hubs.push_back(std::make_pair(std::string(json_object_get_string(idObj)), std::string(json_object_get_string(ipObj))));
+	}
 
-			json_object* configObj;
-			if(downloadJson("http://" + ip + "/api/config", &configObj)) {
-				json_object *nameObj;
-				json_object_object_get_ex(configObj, "name", &nameObj);
+	json_object_put(pnpObj);
+	return true;
+}
 
-				std::string name = json_object_get_string(nameObj);
-				device = new HubDevice(id, ip, name, config);
+bool Hue::getHubName(const std::string& ip, std::string& name) {
+	json_object* configObj;
+	if(!downloadJson("http://" + ip + "/api/config", &configObj)) {
+		return false;
+	}
 
-				json_object_put(configObj);
+	json_object *nameObj;
+	json_object_object_get_ex(configObj, "name", &nameObj);
 
-				break;
-			}
-		}
+	name = json_object_get_string(nameObj);
 
-		json_object_put(pnpObj);
-	} else {
+	json_object_put(configObj);
+	return true;
+}
+
+HubDevice* Hue::getHubDevice(const std::string& deviceID, HueConfig& config) {
+	std::vector<std::pair<std::string, std::string> > hubs;
+	if(!discoverHubs(hubs)) {
 		return NULL;
 	}
 
-	return device;
+	for(std::vector<std::pair<std::string, std::string> >::const_iterator it = hubs.begin(); it != hubs.end(); ++it) {
+		if(it->first != deviceID) {
+			continue;
+		}
+
+		std::string name;
+		if(getHubName(it->second, name)) {
+			return new HubDevice(it->first, it->second, name, config);
+		}
+	}
+
+	return NULL;
 }
 
 bool Hue::getHubDevices(std::vector<HubDevice *> &devices, HueConfig& config) {
 	std::vector<std::string> deviceIds;
 
-	json_object* pnpObj;
-	if(downloadJson("https://www.meethue.com/api/nupnp", &pnpObj)) {
-		for(int i = 0; i < json_object_array_length(pnpObj); i++) {
-			json_object *idObj, *ipObj;
-			json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "id", &idObj);
-			json_object_object_get_ex(json_object_array_get_idx(pnpObj, i), "internalipaddress", &ipObj);
-
-			std::string id = json_object_get_string(idObj);
-			std::string ip = json_object_get_string(ipObj);
-
-			json_object* configObj;
-			if(downloadJson("http://" + ip + "/api/config", &configObj)) {
-				json_object *nameObj;
-				json_object_object_get_ex(configObj, "name", &nameObj);
-
-				std::string name = json_object_get_string(nameObj);
-
-				bool found = false;
-				for(std::vector<HubDevice*>::iterator it = devices.begin(); it != devices.end(); ++it) {
-					if(*(*it) == id) {
-						(*it)->update(id, ip, name);
-
-						found = true;
-						break;
-					}
-				}
+	std::vector<std::pair<std::string, std::string> > hubs;
+	if(!discoverHubs(hubs)) {
+		return false;
+	}
 
-				if(!found) {
-					devices.push_back(new HubDevice(id, ip, name, config));
-				}
+	for(std::vector<std::pair<std::string, std::string> >::const_iterator hubIt = hubs.begin(); hubIt != hubs.end(); ++hubIt) {
+		const std::string& id = hubIt->first;
+		const std::string& ip = hubIt->second;
 
-				deviceIds.push_back(id);
+		std::string name;
+		if(getHubName(ip, name)) {
+			bool found = false;
+			for(std::vector<HubDevice*>::iterator it = devices.begin(); it != devices.end(); ++it) {
+				if(*(*it) == id) {
+					(*it)->update(id, ip, name);
 
-				json_object_put(configObj);
+					found = true;
+					break;
+				}
 			}
-		}
 
-		json_object_put(pnpObj);
-	} else {
-		return false;
+			if(!found) {
+				devices.push_back(new HubDevice(id, ip, name, config));
+			}
+
+			deviceIds.push_back(id);
+		}
 	}
 
 	// Look for removed devices.
@@ -1,6 +1,8 @@
 #include <sstream>
 #include <cstdio>
+#include <cstring>
 #include "logger.h"
+#include "clock.h"
 #include "hue/light.h" 
 #include "connection.h"
 
@@ -10,7 +12,8 @@ HueLightState::HueLightState() :
 	mOn(false),
 	mBrightness(-1),
 	mAlert(""),
-	mReachable(false)
+	mReachable(false),
+	mTransitionTime(0)
 {
 
 }
@@ -21,7 +24,8 @@ HueLightState::HueLightState(const HueLightState* state) :
 	mOn(state->mOn),
 	mBrightness(state->mBrightness),
 	mAlert(state->mAlert),
-	mReachable(state->mReachable)
+	mReachable(state->mReachable),
+	mTransitionTime(state->mTransitionTime)
 {
 
 }
@@ -35,7 +39,9 @@ HueLightState::HueLightState(const HueLightState* state) :
 }
 
 HueLightState::HueLightState(json_object* stateObj)
-	: mValid(false)
+	: mValid(false),
+	mStates(0),
+	mTransitionTime(0)
 {
 	JSON_GET(stateObj, "on", boolean, mOn);
 	JSON_GET(stateObj, "bri", int, mBrightness);
@@ -45,7 +51,7 @@ HueLightState::HueLightState(json_object* stateObj)
 	mValid = true;
 }
 
-void HueLightState::copyTo(HueLightState* other) {
+void HueLightState::copyTo(HueLightState* other) const {
 	if(other == NULL) {
 		return;
 	}
@@ -59,12 +65,37 @@ void HueLightState::copyTo(HueLightState* other) {
 	if((mStates & StateSetAlert) != 0) {
 		other->setAlert(mAlert);
 	}
+	if((mStates & StateSetTransition) != 0) {
+		other->setTransitionTime(mTransitionTime);
+	}
+}
+
+json_object* HueLightState::toJson() const {
+	json_object* obj = json_object_new_object();
+	if(isSet(StateSetPower)) {
+		json_object_object_add(obj, "on", json_object_new_boolean(mOn));
+	}
+	if(isSet(StateSetBrightness)) {
+		json_object_object_add(obj, "bri", json_object_new_int(mBrightness));
+	}
+	if(isSet(StateSetAlert)) {
+		json_object_object_add(obj, "alert", json_object_new_string(mAlert.c_str()));
+	}
+	if(isSet(StateSetTransition)) {
+		json_object_object_add(obj, "transitiontime", json_object_new_int(mTransitionTime));
+	}
+
+	return obj;
 }
 
 HueLight::HueLight(json_object* lightObj, int index)
 	: mValid(false),
 	mState(NULL),
 	mNewState(NULL),
+	mDesired(NULL),
+	mDesiredAt(-1),
+	mWrittenAt(-1),
+	mObservedAt(-1),
 	mIndex(index)
 {	
 	update(lightObj, index);
@@ -77,6 +108,9 @@ HueLight::~HueLight() {
 	if(mNewState != NULL) {
 		delete mNewState;
 	}
+	if(mDesired != NULL) {
+		delete mDesired;
+	}
 }
 
 void HueLight::update(json_object* lightObj, int index) {
@@ -102,32 +136,70 @@ void HueLight::update(json_object* lightObj, int index) {
 	json_object* stateObj;
 	json_object_object_get_ex(lightObj, "state", &stateObj);
 	mState = new HueLightState(stateObj);
+	mObservedAt = Clock::now();
 
 	mValid = true;
 }
 
+void HueLight::setDesired(const HueLightState& state) {
+	if(!state.isSet(HueLightState::StateSetPower) && !state.isSet(HueLightState::StateSetBrightness)) {
+		return;
+	}
+
+	HueLightState desired;
+	if(mDesired != NULL) {
+		mDesired->copyTo(&desired);
+	}
+
+	if(state.isSet(HueLightState::StateSetPower)) {
+		desired.setOn(state.on());
+	}
+	if(state.isSet(HueLightState::StateSetBrightness)) {
+		desired.setBrightness(state.brightness());
+	}
+
+	// Writing the same state again doesn't extend how long it is held on to.
+	time_t now = Clock::now();
+	if(mDesired == NULL || *mDesired != desired) {
+		delete mDesired;
+		mDesired = new HueLightState(&desired);
+		mDesiredAt = now;
+	}
+
+	mWrittenAt = now;
+}
+
+void HueLight::clearDesired() {
+	delete mDesired;
+	mDesired = NULL;
+}
+
+bool HueLight::hasDesired() const {
+	if(mDesired == NULL) {
+		return true;
+	}
+
+	return (!mDesired->isSet(HueLightState::StateSetPower) || mDesired->on() == mState->on())
+		&& (!mDesired->isSet(HueLightState::StateSetBrightness) || mDesired->brightness() == mState->brightness());
+}
+
 bool HueLight::write(const HubDevice& device) {
-	Logger::debug() << "Write '" << mName << "'\n";
+	LOG_DEBUG() << "Write '" << mName << "'\n";
 	if(mNewState == NULL) {
 		Logger::warning() << "New state is NULL\n";
 		return false;
 	}
 
+	// Kept even if the write fails, the reconciler takes care of it then. Also when nothing is written,
+	// so that an older failed write isn't brought back over this one.
+	setDesired(*newState());
+
 	if(*state() == *newState()) {
 		Logger::warning() << "Not updating state for " << mName << " since the old and new are identical\n";
 		return true;
 	}
 
-	json_object* obj = json_object_new_object();
-	if(newState()->isSet(HueLightState::StateSetPower)) {
-		json_object_object_add(obj, "on", json_object_new_boolean(newState()->on()));
-	}
-	if(newState()->isSet(HueLightState::StateSetBrightness)) {
-		json_object_object_add(obj, "bri", json_object_new_int(newState()->brightness()));
-	}
-	if(newState()->isSet(HueLightState::StateSetAlert)) {
-		json_object_object_add(obj, "alert", json_object_new_string(newState()->alert().c_str()));
-	}
+	json_object* obj = newState()->toJson();
 
 	std::ostringstream url;
 	url << "http://"
@@ -138,9 +210,11 @@ bool HueLight::write(const HubDevice& device) {
 		<< mIndex
 		<< "/state";
 
-	Logger::debug() << "Writing state for '" << mName << "' to '" << url.str() << "'\n";
+	LOG_DEBUG() << "Writing state for '" << mName << "' to '" << url.str() << "'\n";
 
 	//url << "http://192.168.1.101";
+	device.countCommands(Clock::now());
+
 	json_object* output;
 	if(!putJson(url.str(), obj, &output)) {
 		Logger::error() << "Could not write state for '" << mName << "'' to '" << url.str() << "'\n";
@@ -164,13 +238,63 @@ bool HueLight::write(const HubDevice& device) {
 	json_object_put(output);
 	json_object_put(obj);
 
+	acceptNewState();
+	return true;
+}
+
+void HueLight::written() {
+	if(mNewState == NULL) {
+		return;
+	}
+
+	setDesired(*mNewState);
+	acceptNewState();
+}
+
+void HueLight::acceptNewState() {
 	// The light should now have the new parameters, so copy the new state object to the old one.
 	HueLightState* tmpState = mState;
 	mState = mNewState;
+	mState->clearTransitionTime();
 	delete tmpState;
 	mNewState = NULL;
+}
 
-	return true;
+bool HueLight::refresh(const HubDevice& device, size_t* bytes) {
+	std::ostringstream url;
+	url << "http://"
+		<< device.ip()
+		<< "/api/"
+		<< device.user()
+		<< "/lights/"
+		<< mIndex;
+
+	json_object* lightObj;
+	if(!downloadJson(url.str(), &lightObj)) {
+		Logger::warning() << "Could not refresh state for '" << mName << "'\n";
+		return false;
+	}
+
+	if(bytes != NULL) {
+		*bytes = strlen(json_object_to_json_string(lightObj));
+	}
+
+	json_object* stateObj;
+	bool found = json_object_object_get_ex(lightObj, "state", &stateObj);
+	if(found) {
+		HueLightState* state = new HueLightState(stateObj);
+		if(state->valid()) {
+			delete mState;
+			mState = state;
+			mObservedAt = Clock::now();
+		} else {
+			delete state;
+			found = false;
+		}
+	}
+
+	json_object_put(lightObj);
+	return found;
 }
 
 json_object* HueLight::toJson() const {
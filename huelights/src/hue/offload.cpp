@@ -0,0 +1,237 @@
+#include <map>
+#include <cstdio>
+#include "logger.h"
+#include "utils.h"
+#include "connection.h"
+#include "hue/offload.h"
+#include "hue/hub.h"
+#include "hue/light.h"
+#include "hue/task.h"
+
+static const std::string sPrefix = "huelights ";
+
+// The bridge holds no more than this many schedules, including the ones that aren't ours.
+static const size_t sMaxSchedules = 100;
+
+HueScheduleOffload::HueScheduleOffload()
+	: mFingerprint(sHashBasis),
+	mSyncedAt(-1),
+	mOwnsSchedules(true)
+{
+
+}
+
+bool HueScheduleOffload::sync(HubDevice& device, time_t now) {
+	TaskSchedules tasks;
+	if(device.offload() && device.isAuthorized()) {
+		collect(device, now, tasks);
+	}
+
+	std::set<std::string> wanted;
+	uint64_t fingerprint = sHashBasis;
+	for(TaskSchedules::const_iterator it = tasks.begin(); it != tasks.end(); ++it) {
+		for(std::vector<Schedule>::const_iterator scheduleIt = it->second.begin(); scheduleIt != it->second.end(); ++scheduleIt) {
+			wanted.insert(scheduleIt->description);
+			fingerprint = hash(scheduleIt->description, fingerprint);
+		}
+	}
+
+	bool verify = mSyncedAt < 0 || now < mSyncedAt || now - mSyncedAt >= device.verifyInterval();
+	if(fingerprint == mFingerprint && !verify) {
+		return true;
+	}
+
+	if(wanted.empty() && !mOwnsSchedules) {
+		mFingerprint = fingerprint;
+		mSyncedAt = now;
+		mOffloaded.clear();
+		return true;
+	}
+
+	json_object* schedulesObj;
+	if(!downloadJson("http://" + device.ip() + "/api/" + device.user() + "/schedules", &schedulesObj)) {
+		Logger::warning() << "Could not get the schedules of hub " << device.id() << "\n";
+		return false;
+	}
+
+	if(!json_object_is_type(schedulesObj, json_type_object)) {
+		Logger::warning() << "Could not get the schedules of hub " << device.id() << "\n";
+		json_object_put(schedulesObj);
+		return false;
+	}
+
+	// Ours by description, everything else only counts towards the limit.
+	std::map<std::string, std::string> existing;
+	std::vector<std::string> stale;
+	size_t foreign = 0;
+
+	json_object_object_foreach(schedulesObj, key, val) {
+		std::string description;
+
+		json_object* descriptionObj;
+		if(json_object_object_get_ex(val, "description", &descriptionObj)) {
+			description = json_object_get_string(descriptionObj);
+		}
+
+		if(description.compare(0, sPrefix.size(), sPrefix) != 0) {
+			foreign++;
+		} else if(wanted.count(description) == 0 || existing.count(description) != 0) {
+			stale.push_back(key);
+		} else {
+			existing[description] = key;
+		}
+	}
+
+	json_object_put(schedulesObj);
+
+	size_t deleted = 0;
+	for(std::vector<std::string>::const_iterator it = stale.begin(); it != stale.end(); ++it) {
+		if(remove(device, *it)) {
+			deleted++;
+		}
+	}
+
+	size_t room = (foreign + existing.size() < sMaxSchedules) ? sMaxSchedules - foreign - existing.size() : 0;
+	size_t created = 0;
+
+	// A task is only offloaded with all of its lights, otherwise it stays here and none of its schedules are kept.
+	mOffloaded.clear();
+	for(TaskSchedules::const_iterator it = tasks.begin(); it != tasks.end(); ++it) {
+		std::vector<const Schedule*> missing;
+		for(std::vector<Schedule>::const_iterator scheduleIt = it->second.begin(); scheduleIt != it->second.end(); ++scheduleIt) {
+			if(existing.count(scheduleIt->description) == 0) {
+				missing.push_back(&*scheduleIt);
+			}
+		}
+
+		bool complete = missing.size() <= room;
+		for(std::vector<const Schedule*>::const_iterator scheduleIt = missing.begin(); complete && scheduleIt != missing.end(); ++scheduleIt) {
+			std::string id;
+			if(!create(device, *(*scheduleIt), id)) {
+				complete = false;
+				break;
+			}
+
+			existing[(*scheduleIt)->description] = id;
+			room--;
+			created++;
+		}
+
+		if(complete) {
+			mOffloaded.insert(it->first);
+			continue;
+		}
+
+		for(std::vector<Schedule>::const_iterator scheduleIt = it->second.begin(); scheduleIt != it->second.end(); ++scheduleIt) {
+			std::map<std::string, std::string>::iterator existingIt = existing.find(scheduleIt->description);
+			if(existingIt != existing.end() && remove(device, existingIt->second)) {
+				existing.erase(existingIt);
+				deleted++;
+				room++;
+			}
+		}
+	}
+
+	if(created > 0 || deleted > 0) {
+		Logger::info() << "Hub " << device.id() << " runs " << mOffloaded.size() << " of " << tasks.size() << " offloadable tasks itself, created "
+			<< created << " and deleted " << deleted << " schedules\n";
+	}
+
+	mOwnsSchedules = !existing.empty();
+	mFingerprint = fingerprint;
+	mSyncedAt = now;
+	return true;
+}
+
+void HueScheduleOffload::collect(const HubDevice& device, time_t now, TaskSchedules& tasks) const {
+	for(std::vector<HueTask*>::const_iterator it = device.tasks().begin(); it != device.tasks().end(); ++it) {
+		// Toggles depend on the state of the light, which the bridge schedule doesn't know.
+		std::string localtime;
+		if((*it)->toggles() || (*it)->lights().empty() || !(*it)->bridgeTime(now, localtime)) {
+			continue;
+		}
+
+		json_object* bodyObj = (*it)->state().toJson();
+		std::string body = json_object_to_json_string(bodyObj);
+		json_object_put(bodyObj);
+
+		tasks.push_back(std::make_pair((*it)->id(), std::vector<Schedule>()));
+		std::vector<Schedule>& schedules = tasks.back().second;
+
+		for(std::vector<HueLight*>::const_iterator lightIt = (*it)->lights().begin(); lightIt != (*it)->lights().end(); ++lightIt) {
+			char address[64];
+			snprintf(address, sizeof(address), "/lights/%d/state", (*lightIt)->index());
+
+			Schedule schedule;
+			schedule.name = (*it)->name().substr(0, 32);
+			schedule.address = "/api/" + device.user() + address;
+			schedule.localtime = localtime;
+			schedule.body = body;
+			schedule.recurring = localtime[0] == 'W';
+
+			uint64_t h = hash((*it)->id() + "|" + (*lightIt)->id() + "|" + schedule.name + "|" + schedule.address + "|" + localtime + "|" + body, sHashBasis);
+
+			char description[32];
+			snprintf(description, sizeof(description), "%016llx", (unsigned long long)h);
+			schedule.description = sPrefix + description;
+
+			schedules.push_back(schedule);
+		}
+	}
+}
+
+bool HueScheduleOffload::create(const HubDevice& device, const Schedule& schedule, std::string& id) const {
+	json_object* commandObj = json_object_new_object();
+	json_object_object_add(commandObj, "address", json_object_new_string(schedule.address.c_str()));
+	json_object_object_add(commandObj, "method", json_object_new_string("PUT"));
+	json_object_object_add(commandObj, "body", json_tokener_parse(schedule.body.c_str()));
+
+	json_object* inputObj = json_object_new_object();
+	json_object_object_add(inputObj, "name", json_object_new_string(schedule.name.c_str()));
+	json_object_object_add(inputObj, "description", json_object_new_string(schedule.description.c_str()));
+	json_object_object_add(inputObj, "command", commandObj);
+	json_object_object_add(inputObj, "localtime", json_object_new_string(schedule.localtime.c_str()));
+	json_object_object_add(inputObj, "status", json_object_new_string("enabled"));
+	if(!schedule.recurring) {
+		json_object_object_add(inputObj, "autodelete", json_object_new_boolean(true));
+	}
+
+	json_object* output;
+	bool ret = postJson("http://" + device.ip() + "/api/" + device.user() + "/schedules", inputObj, &output);
+	json_object_put(inputObj);
+
+	if(!ret) {
+		Logger::warning() << "Could not create schedule '" << schedule.name << "' on hub " << device.id() << "\n";
+		return false;
+	}
+
+	ret = false;
+	json_object* successObj;
+	json_object* idObj;
+	if(json_object_array_length(output) == 1
+		&& json_object_object_get_ex(json_object_array_get_idx(output, 0), "success", &successObj)
+		&& json_object_object_get_ex(successObj, "id", &idObj)) {
+		id = json_object_get_string(idObj);
+		ret = true;
+	} else {
+		Logger::warning() << "Hub " << device.id() << " refused schedule '" << schedule.name << "' at " << schedule.localtime << "\n";
+	}
+
+	json_object_put(output);
+	return ret;
+}
+
+bool HueScheduleOffload::remove(const HubDevice& device, const std::string& id) const {
+	json_object* output;
+	if(!deleteJson("http://" + device.ip() + "/api/" + device.user() + "/schedules/" + id, &output)) {
+		Logger::warning() << "Could not delete schedule " << id << " on hub " << device.id() << "\n";
+		return false;
+	}
+
+	json_object_put(output);
+	return true;
+}
+
+uint64_t HueScheduleOffload::hash(const std::string& str, uint64_t h) {
+	return hashBytes(str.data(), str.size(), h);
+}
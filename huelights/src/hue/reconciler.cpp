@@ -0,0 +1,117 @@
+#include <algorithm>
+#include "logger.h"
+#include "hue/reconciler.h"
+#include "hue/hub.h"
+#include "hue/light.h"
+
+HueReconciler::HueReconciler(int settle, int baseDelay, int maxDelay)
+	: mSettle(settle),
+	mBaseDelay(baseDelay),
+	mMaxDelay(maxDelay)
+{
+
+}
+
+size_t HueReconciler::reconcile(HubDevice& device, time_t now, time_t window) {
+	size_t sent = 0;
+	size_t converged = 0;
+	size_t corrected = 0;
+
+	for(std::vector<HueLight*>::const_iterator it = device.lights().begin(); it != device.lights().end() && device.commandsLeft(now) > 0; ++it) {
+		HueLight* light = *it;
+		if(light->desired() == NULL) {
+			continue;
+		}
+
+		if(window <= 0 || now - light->desiredAt() > window) {
+			if(!light->hasDesired()) {
+				Logger::warning() << "Light " << light->id() << " didn't reach its state in " << window << "s, giving up\n";
+			}
+
+			light->clearDesired();
+			mAttempts.erase(light->id());
+			continue;
+		}
+
+		if(now - light->writtenAt() < mSettle) {
+			continue;
+		}
+
+		std::map<std::string, Attempt>::const_iterator attemptIt = mAttempts.find(light->id());
+		if(attemptIt != mAttempts.end() && attemptIt->second.nextAt > now) {
+			continue;
+		}
+
+		// The state has to be read back after the last write, a successful write only tells what the hub was asked.
+		if(light->observedAt() <= light->writtenAt()) {
+			sent++;
+			device.countCommands(now);
+			if(!device.refreshLight(light)) {
+				backoff(light->id(), now);
+				continue;
+			}
+		}
+
+		if(light->hasDesired()) {
+			light->clearDesired();
+			mAttempts.erase(light->id());
+			converged++;
+			continue;
+		}
+
+		// The hub can't do anything about unreachable lights, look again later.
+		if(!light->state()->reachable() || device.commandsLeft(now) == 0) {
+			backoff(light->id(), now);
+			continue;
+		}
+
+		// Only what differs is written again.
+		const HueLightState* desired = light->desired();
+		HueLightState* state = light->newState();
+		state->reset();
+		if(desired->isSet(HueLightState::StateSetPower) && desired->on() != light->state()->on()) {
+			state->setOn(desired->on());
+		}
+		if(desired->isSet(HueLightState::StateSetBrightness) && desired->brightness() != light->state()->brightness()) {
+			state->setBrightness(desired->brightness());
+		}
+
+		Logger::info() << "Light " << light->id() << " drifted from its state, correcting\n";
+
+		sent++;
+		corrected++;
+		light->write(device);
+		backoff(light->id(), now);
+	}
+
+	if(corrected > 0) {
+		Logger::info() << "Corrected " << corrected << " and confirmed " << converged << " lights on hub " << device.id() << "\n";
+	}
+
+	return sent;
+}
+
+void HueReconciler::clear() {
+	mAttempts.clear();
+}
+
+void HueReconciler::backoff(const std::string& id, time_t now) {
+	std::map<std::string, Attempt>::iterator it = mAttempts.find(id);
+	if(it == mAttempts.end()) {
+		Attempt attempt;
+		attempt.attempts = 0;
+		attempt.nextAt = 0;
+
+		it = mAttempts.insert(std::make_pair(id, attempt)).first;
+	}
+
+	Attempt& attempt = it->second;
+
+	int delay = mMaxDelay;
+	if(attempt.attempts < 16) {
+		delay = std::min(mMaxDelay, mBaseDelay << attempt.attempts);
+	}
+
+	attempt.attempts++;
+	attempt.nextAt = now + delay;
+}
@@ -0,0 +1,103 @@
+#include <cstdlib>
+#include <algorithm>
+#include <stdint.h>
+#include "hue/retry.h"
+
+HueRetryQueue::HueRetryQueue(int baseDelay, int maxDelay)
+	: mBaseDelay(baseDelay),
+	mMaxDelay(maxDelay),
+	mSeed(time(NULL) ^ (uintptr_t)this)
+{
+
+}
+
+bool HueRetryQueue::failed(const std::string& id, time_t now, time_t deadline) {
+	std::map<std::string, Entry>::iterator it = mEntries.find(id);
+	if(it == mEntries.end()) {
+		Entry entry;
+		entry.attempts = 0;
+		entry.retryAt = 0;
+		entry.deadline = deadline;
+
+		it = mEntries.insert(std::make_pair(id, entry)).first;
+	} else {
+		mQueue.erase(std::make_pair(it->second.retryAt, id));
+	}
+
+	Entry& entry = it->second;
+
+	int delay = mMaxDelay;
+	if(entry.attempts < 16) {
+		delay = std::min(mMaxDelay, mBaseDelay << entry.attempts);
+	}
+
+	// +-25% jitter, so that tasks that failed together don't retry together.
+	int jitter = delay / 4;
+	if(jitter > 0) {
+		delay += (rand_r(&mSeed) % (2 * jitter + 1)) - jitter;
+	}
+
+	entry.attempts++;
+	entry.retryAt = now + std::max(1, delay);
+
+	if(entry.retryAt > entry.deadline) {
+		mEntries.erase(it);
+		return false;
+	}
+
+	mQueue.insert(std::make_pair(entry.retryAt, id));
+	return true;
+}
+
+void HueRetryQueue::remove(const std::string& id) {
+	std::map<std::string, Entry>::iterator it = mEntries.find(id);
+	if(it == mEntries.end()) {
+		return;
+	}
+
+	mQueue.erase(std::make_pair(it->second.retryAt, id));
+	mEntries.erase(it);
+}
+
+void HueRetryQueue::clear() {
+	mQueue.clear();
+	mEntries.clear();
+}
+
+time_t HueRetryQueue::next() const {
+	if(mQueue.empty()) {
+		return -1;
+	}
+
+	return mQueue.begin()->first;
+}
+
+bool HueRetryQueue::pop(time_t now, std::string& id) {
+	if(mQueue.empty() || mQueue.begin()->first > now) {
+		return false;
+	}
+
+	// The entry itself stays until the task succeeds or is given up on, so the attempts keep counting.
+	id = mQueue.begin()->second;
+	mQueue.erase(mQueue.begin());
+	return true;
+}
+
+void HueRetryQueue::postpone(time_t now) {
+	while(!mQueue.empty() && mQueue.begin()->first <= now) {
+		std::string id = mQueue.begin()->second;
+		mQueue.erase(mQueue.begin());
+
+		mEntries[id].retryAt = now + 1;
+		mQueue.insert(std::make_pair(now + 1, id));
+	}
+}
+
+int HueRetryQueue::attempts(const std::string& id) const {
+	std::map<std::string, Entry>::const_iterator it = mEntries.find(id);
+	if(it == mEntries.end()) {
+		return 0;
+	}
+
+	return it->second.attempts;
+}
@@ -0,0 +1,80 @@
+#include <sstream>
+#include "hue/schedule.h"
+#include "hue/hub.h"
+#include "hue/task.h"
+
+static std::string formatTime(time_t t) {
+	struct tm tm;
+	localtime_r(&t, &tm);
+
+	char buf[80];
+	strftime(buf, 80, "%Y-%m-%d %H:%M", &tm);
+	return buf;
+}
+
+HueSchedule::HueSchedule(time_t from, time_t to, size_t count)
+	: mFrom(from),
+	mTo(to),
+	mCount(count)
+{
+
+}
+
+void HueSchedule::project(const HubDevice& device) {
+	mEntries.reserve(mEntries.size() + device.tasks().size());
+
+	for(std::vector<HueTask*>::const_iterator it = device.tasks().begin(); it != device.tasks().end(); ++it) {
+		mEntries.push_back(Entry());
+		mEntries.back().task = *it;
+		(*it)->project(mFrom, mTo, mCount, mEntries.back().times);
+	}
+}
+
+void HueSchedule::project(const std::vector<HubDevice*>& devices) {
+	for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
+		project(*(*it));
+	}
+}
+
+json_object* HueSchedule::toJson() const {
+	json_object* arrObj = json_object_new_array();
+	for(std::vector<Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+		json_object* obj = json_object_new_object();
+		json_object_object_add(obj, "id", json_object_new_string(it->task->id().c_str()));
+		json_object_object_add(obj, "name", json_object_new_string(it->task->name().c_str()));
+		json_object_object_add(obj, "hub", json_object_new_string(it->task->device().id().c_str()));
+		json_object_object_add(obj, "enabled", json_object_new_boolean(it->task->enabled()));
+
+		json_object* timesObj = json_object_new_array();
+		for(std::vector<time_t>::const_iterator timeIt = it->times.begin(); timeIt != it->times.end(); ++timeIt) {
+			json_object* timeObj = json_object_new_object();
+			json_object_object_add(timeObj, "time", json_object_new_int64(*timeIt));
+			json_object_object_add(timeObj, "local", json_object_new_string(formatTime(*timeIt).c_str()));
+			json_object_array_add(timesObj, timeObj);
+		}
+
+		json_object_object_add(obj, "triggers", timesObj);
+		json_object_array_add(arrObj, obj);
+	}
+
+	return arrObj;
+}
+
+std::string HueSchedule::toString() const {
+	std::ostringstream s;
+	for(std::vector<Entry>::const_iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+		if(it != mEntries.begin()) {
+			s << "\n\n";
+		}
+
+		s << "[Task " << it->task->id() << " Schedule]"
+			<< "\n" << "name=" << it->task->name()
+			<< "\n" << "hub=" << it->task->device().id();
+
+		for(std::vector<time_t>::const_iterator timeIt = it->times.begin(); timeIt != it->times.end(); ++timeIt) {
+			s << "\n" << "trigger=" << formatTime(*timeIt);
+		}
+	}
+
+	return s.str();
+}
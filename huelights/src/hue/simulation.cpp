@@ -0,0 +1,469 @@
+#include <sstream>
+#include <queue>
+#include <set>
+#include <cstdlib>
+#include <stdint.h>
+#include "logger.h"
+#include "clock.h"
+#include "utils.h"
+#include "hue/hue.h"
+#include "hue/simulation.h"
+
+static std::string formatTime(time_t t) {
+	struct tm tm;
+	localtime_r(&t, &tm);
+
+	// Seconds only for the triggers in between the minutes.
+	char buf[80];
+	strftime(buf, 80, (t % 60 == 0) ? "%Y-%m-%d %H:%M" : "%Y-%m-%d %H:%M:%S", &tm);
+	return buf;
+}
+
+// Logs at info against level, rather than the level the tasks run with.
+static void report(LOGGER_LEVEL level, const std::string& line) {
+	LOGGER_LEVEL taskLevel = Logger::level();
+	Logger::setLevel(level);
+	Logger::info() << line;
+	Logger::setLevel(taskLevel);
+}
+
+SimulatedTransport::SimulatedTransport(const HueConfig& config)
+	: mRequests(0),
+	mWrites(0)
+{
+	const std::vector<HueConfigSection*>& hubSections = config.getSections("Hub");
+	for(std::vector<HueConfigSection*>::const_iterator it = hubSections.begin(); it != hubSections.end(); ++it) {
+		std::ostringstream ip;
+		ip << "192.0.2." << (mHubs.size() + 1);
+
+		Hub hub;
+		hub.id = (*it)->value("id");
+		hub.ip = ip.str();
+		hub.name = (*it)->value("name", "Simulated hub");
+		hub.nextSchedule = 1;
+		hub.nextGroup = 1;
+
+		std::set<std::string> lightIDs;
+		const std::vector<HueConfigSection*>& taskSections = config.getSections("Task", "hub", hub.id);
+		for(std::vector<HueConfigSection*>::const_iterator taskIt = taskSections.begin(); taskIt != taskSections.end(); ++taskIt) {
+			const std::vector<std::string>& lights = (*taskIt)->listValue("lights");
+			lightIDs.insert(lights.begin(), lights.end());
+		}
+
+		for(std::set<std::string>::const_iterator lightIt = lightIDs.begin(); lightIt != lightIDs.end(); ++lightIt) {
+			Light light;
+			light.id = *lightIt;
+			light.on = false;
+			light.brightness = 0;
+			light.alert = "none";
+
+			hub.lights.push_back(light);
+		}
+
+		mHubs.push_back(hub);
+	}
+}
+
+SimulatedTransport::Hub* SimulatedTransport::hub(const std::string& url, std::string& path) {
+	static const std::string prefix = "http://";
+	if(url.compare(0, prefix.size(), prefix) != 0) {
+		return NULL;
+	}
+
+	size_t pos = url.find('/', prefix.size());
+	std::string ip = url.substr(prefix.size(), pos - prefix.size());
+	path = (pos == std::string::npos) ? "" : url.substr(pos);
+
+	for(std::vector<Hub>::iterator it = mHubs.begin(); it != mHubs.end(); ++it) {
+		if(it->ip == ip) {
+			return &(*it);
+		}
+	}
+
+	return NULL;
+}
+
+json_object* SimulatedTransport::lightToJson(const Light& light) const {
+	json_object* stateObj = json_object_new_object();
+	json_object_object_add(stateObj, "on", json_object_new_boolean(light.on));
+	json_object_object_add(stateObj, "bri", json_object_new_int(light.brightness));
+	json_object_object_add(stateObj, "alert", json_object_new_string(light.alert.c_str()));
+	json_object_object_add(stateObj, "reachable", json_object_new_boolean(true));
+
+	json_object* obj = json_object_new_object();
+	json_object_object_add(obj, "type", json_object_new_string("Dimmable light"));
+	json_object_object_add(obj, "name", json_object_new_string(("Light " + light.id).c_str()));
+	json_object_object_add(obj, "modelid", json_object_new_string("SIM001"));
+	json_object_object_add(obj, "manufacturername", json_object_new_string("huelights"));
+	json_object_object_add(obj, "uniqueid", json_object_new_string(light.id.c_str()));
+	json_object_object_add(obj, "swversion", json_object_new_string("1"));
+	json_object_object_add(obj, "state", stateObj);
+
+	return obj;
+}
+
+bool SimulatedTransport::downloadJson(const std::string& url, json_object** output) {
+	mRequests++;
+
+	if(url == "https://www.meethue.com/api/nupnp") {
+		*output = json_object_new_array();
+		for(std::vector<Hub>::const_iterator it = mHubs.begin(); it != mHubs.end(); ++it) {
+			json_object* obj = json_object_new_object();
+			json_object_object_add(obj, "id", json_object_new_string(it->id.c_str()));
+			json_object_object_add(obj, "internalipaddress", json_object_new_string(it->ip.c_str()));
+			json_object_array_add(*output, obj);
+		}
+
+		return true;
+	}
+
+	std::string path;
+	Hub* h = hub(url, path);
+	if(h == NULL) {
+		return false;
+	}
+
+	if(path == "/api/config") {
+		*output = json_object_new_object();
+		json_object_object_add(*output, "name", json_object_new_string(h->name.c_str()));
+		return true;
+	}
+
+	// /api/<user>/schedules
+	std::vector<std::string> parts;
+	commaListToVector(path, parts, '/');
+	if(parts.size() == 3 && parts[0] == "api" && parts[2] == "schedules") {
+		*output = json_object_new_object();
+		for(std::map<int, std::string>::const_iterator it = h->schedules.begin(); it != h->schedules.end(); ++it) {
+			std::ostringstream id;
+			id << it->first;
+			json_object_object_add(*output, id.str().c_str(), json_tokener_parse(it->second.c_str()));
+		}
+
+		return true;
+	}
+
+	// /api/<user>/lights[/<index>]
+	if(parts.size() < 3 || parts[0] != "api" || parts[2] != "lights") {
+		return false;
+	}
+
+	if(parts.size() == 3) {
+		*output = json_object_new_object();
+		for(size_t i = 0; i < h->lights.size(); i++) {
+			std::ostringstream index;
+			index << (i + 1);
+			json_object_object_add(*output, index.str().c_str(), lightToJson(h->lights[i]));
+		}
+
+		return true;
+	}
+
+	size_t index = atoi(parts[3].c_str());
+	if(parts.size() != 4 || index < 1 || index > h->lights.size()) {
+		return false;
+	}
+
+	*output = lightToJson(h->lights[index - 1]);
+	return true;
+}
+
+bool SimulatedTransport::postJson(const std::string& url, json_object* input, json_object** output) {
+	mRequests++;
+
+	std::string path;
+	Hub* h = hub(url, path);
+	if(h == NULL) {
+		return false;
+	}
+
+	// /api/<user>/schedules
+	std::vector<std::string> parts;
+	commaListToVector(path, parts, '/');
+	if(parts.size() == 3 && parts[0] == "api" && parts[2] == "schedules") {
+		int id = h->nextSchedule++;
+		h->schedules[id] = json_object_to_json_string(input);
+
+		std::ostringstream idStr;
+		idStr << id;
+
+		json_object* idObj = json_object_new_object();
+		json_object_object_add(idObj, "id", json_object_new_string(idStr.str().c_str()));
+
+		*output = json_object_new_array();
+		json_object_array_add(*output, success(idObj));
+		return true;
+	}
+
+	// /api/<user>/groups
+	if(parts.size() == 3 && parts[0] == "api" && parts[2] == "groups") {
+		json_object* lightsObj;
+		if(!json_object_object_get_ex(input, "lights", &lightsObj)) {
+			return false;
+		}
+
+		int id = h->nextGroup++;
+		std::vector<size_t>& group = h->groups[id];
+		for(int i = 0; i < json_object_array_length(lightsObj); i++) {
+			size_t index = atoi(json_object_get_string(json_object_array_get_idx(lightsObj, i)));
+			if(index >= 1 && index <= h->lights.size()) {
+				group.push_back(index - 1);
+			}
+		}
+
+		std::ostringstream idStr;
+		idStr << id;
+
+		json_object* idObj = json_object_new_object();
+		json_object_object_add(idObj, "id", json_object_new_string(idStr.str().c_str()));
+
+		*output = json_object_new_array();
+		json_object_array_add(*output, success(idObj));
+		return true;
+	}
+
+	if(path != "/api") {
+		return false;
+	}
+
+	json_object* successObj = json_object_new_object();
+	json_object_object_add(successObj, "username", json_object_new_string("simulated"));
+
+	*output = json_object_new_array();
+	json_object_array_add(*output, success(successObj));
+	return true;
+}
+
+bool SimulatedTransport::putJson(const std::string& url, json_object* input, json_object** output) {
+	mRequests++;
+
+	std::string path;
+	Hub* h = hub(url, path);
+	if(h == NULL) {
+		return false;
+	}
+
+	// /api/<user>/lights/<index>/state or /api/<user>/groups/<id>/action
+	std::vector<std::string> parts;
+	commaListToVector(path, parts, '/');
+	if(parts.size() != 5 || parts[0] != "api") {
+		return false;
+	}
+
+	if(parts[2] == "groups" && parts[4] == "action") {
+		std::map<int, std::vector<size_t> >::const_iterator groupIt = h->groups.find(atoi(parts[3].c_str()));
+		if(groupIt == h->groups.end()) {
+			return false;
+		}
+
+		for(std::vector<size_t>::const_iterator it = groupIt->second.begin(); it != groupIt->second.end(); ++it) {
+			setState(h->lights[*it], input);
+		}
+	} else if(parts[2] == "lights" && parts[4] == "state") {
+		size_t index = atoi(parts[3].c_str());
+		if(index < 1 || index > h->lights.size()) {
+			return false;
+		}
+
+		setState(h->lights[index - 1], input);
+	} else {
+		return false;
+	}
+
+	mWrites++;
+
+	*output = json_object_new_array();
+	json_object_object_foreach(input, key, val) {
+		std::string k = key;
+		json_object* successObj = json_object_new_object();
+		json_object_object_add(successObj, (path + "/" + k).c_str(), json_object_get(val));
+		json_object_array_add(*output, success(successObj));
+	}
+
+	return true;
+}
+
+bool SimulatedTransport::deleteJson(const std::string& url, json_object** output) {
+	mRequests++;
+
+	std::string path;
+	Hub* h = hub(url, path);
+	if(h == NULL) {
+		return false;
+	}
+
+	// /api/<user>/schedules/<id> or /api/<user>/groups/<id>
+	std::vector<std::string> parts;
+	commaListToVector(path, parts, '/');
+	if(parts.size() != 4 || parts[0] != "api") {
+		return false;
+	}
+
+	if(parts[2] == "groups") {
+		if(h->groups.erase(atoi(parts[3].c_str())) == 0) {
+			return false;
+		}
+
+		*output = json_object_new_array();
+		json_object_array_add(*output, success(json_object_new_string(("/groups/" + parts[3] + " deleted").c_str())));
+		return true;
+	}
+
+	if(parts[2] != "schedules") {
+		return false;
+	}
+
+	*output = json_object_new_array();
+	if(h->schedules.erase(atoi(parts[3].c_str())) == 0) {
+		json_object* errorObj = json_object_new_object();
+		json_object_object_add(errorObj, "type", json_object_new_int(3));
+		json_object_object_add(errorObj, "description", json_object_new_string("resource not available"));
+
+		json_object* obj = json_object_new_object();
+		json_object_object_add(obj, "error", errorObj);
+		json_object_array_add(*output, obj);
+		return true;
+	}
+
+	json_object_array_add(*output, success(json_object_new_string(("/schedules/" + parts[3] + " deleted").c_str())));
+	return true;
+}
+
+void SimulatedTransport::setState(Light& light, json_object* input) {
+	json_object_object_foreach(input, key, val) {
+		std::string k = key;
+		if(k == "on") {
+			light.on = json_object_get_boolean(val);
+		} else if(k == "bri") {
+			light.brightness = json_object_get_int(val);
+		} else if(k == "alert") {
+			light.alert = json_object_get_string(val);
+		}
+	}
+}
+
+size_t SimulatedTransport::schedules() const {
+	size_t count = 0;
+	for(std::vector<Hub>::const_iterator it = mHubs.begin(); it != mHubs.end(); ++it) {
+		count += it->schedules.size();
+	}
+
+	return count;
+}
+
+json_object* SimulatedTransport::success(json_object* value) {
+	json_object* obj = json_object_new_object();
+	json_object_object_add(obj, "success", value);
+	return obj;
+}
+
+HueSimulation::HueSimulation(HueConfig& config, time_t from, time_t to, LOGGER_LEVEL taskLevel)
+	: mConfig(config),
+	mFrom(from),
+	mTo(to),
+	mTaskLevel(taskLevel)
+{
+
+}
+
+bool HueSimulation::run() {
+	LOGGER_LEVEL level = Logger::level();
+	Logger::setLevel(mTaskLevel);
+
+	SimulatedTransport transport(mConfig);
+	setTransport(&transport);
+	Clock::setTime(mFrom);
+
+	std::vector<HubDevice*> devices;
+	if(!Hue::getHubDevices(devices, mConfig)) {
+		setTransport(NULL);
+		Clock::reset();
+		Logger::setLevel(level);
+		return false;
+	}
+
+	struct timespec startTs;
+	clock_gettime(CLOCK_MONOTONIC, &startTs);
+
+	// Ordered by trigger time, then by the order of the tasks so that the output is stable.
+	typedef std::pair<time_t, size_t> QueueItem;
+	std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem> > queue;
+
+	std::vector<HueTask*> tasks;
+	for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
+		tasks.insert(tasks.end(), (*it)->tasks().begin(), (*it)->tasks().end());
+	}
+
+	for(size_t i = 0; i < tasks.size(); i++) {
+		time_t next = tasks[i]->nextTrigger();
+		if(next >= mFrom) {
+			queue.push(std::make_pair(next, i));
+		}
+	}
+
+	size_t triggers = 0;
+	size_t fadeSteps = 0;
+	while(true) {
+		// Fade steps that come before the next trigger go first.
+		HubDevice* fadeDevice = NULL;
+		time_t fadeAt = -1;
+		for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
+			time_t next = (*it)->fades().next();
+			if(next >= 0 && (fadeAt < 0 || next < fadeAt)) {
+				fadeAt = next;
+				fadeDevice = *it;
+			}
+		}
+
+		bool tasksDone = queue.empty() || queue.top().first >= mTo;
+		if(fadeDevice != NULL && fadeAt < mTo && (tasksDone || fadeAt < queue.top().first)) {
+			Clock::setTime(fadeAt);
+			fadeSteps += fadeDevice->fades().step(*fadeDevice, fadeAt);
+			continue;
+		}
+
+		if(tasksDone) {
+			break;
+		}
+
+		time_t t = queue.top().first;
+		HueTask* task = tasks[queue.top().second];
+		size_t index = queue.top().second;
+		queue.pop();
+
+		Clock::setTime(t);
+
+		bool error = false;
+		if(task->execute(error)) {
+			std::ostringstream line;
+			line << formatTime(t) << " " << task->device().id() << " " << task->id() << " (" << task->name() << ")\n";
+			report(level, line.str());
+			triggers++;
+		}
+
+		time_t next = task->nextTrigger();
+		if(next > t) {
+			queue.push(std::make_pair(next, index));
+		}
+	}
+
+	struct timespec endTs;
+	clock_gettime(CLOCK_MONOTONIC, &endTs);
+	uint64_t elapsed = (endTs.tv_sec - startTs.tv_sec) * 1000 + (endTs.tv_nsec - startTs.tv_nsec) / 1000000;
+
+	std::ostringstream summary;
+	summary << "Simulated " << formatTime(mFrom) << " to " << formatTime(mTo) << ": "
+		<< tasks.size() << " tasks, " << triggers << " triggers, " << fadeSteps << " fade steps, " << transport.writes() << " light writes in "
+		<< elapsed << " ms\n";
+	report(level, summary.str());
+
+	for(std::vector<HubDevice*>::iterator it = devices.begin(); it != devices.end(); ++it) {
+		delete *it;
+	}
+
+	setTransport(NULL);
+	Clock::reset();
+	Logger::setLevel(level);
+
+	return true;
+}
@@ -1,16 +1,20 @@
 #include <sstream>
 #include <cstdlib>
 #include <iomanip>
+#include <algorithm>
 #include "logger.h"
 #include "hue/task.h" 
-#include "hue/tasks/task_time.h"
+#include "hue/fade.h"
 #include "utils.h"
 
 HueTask::HueTask(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device)
 	: mValid(false),
 	mDevice(device),
 	mEnabled(false),
-	mStateToggle(false)
+	mCritical(false),
+	mRetryWindow(300),
+	mStateToggle(false),
+	mFingerprint(0)
 {
 	// Type has to be set, or the update method won't work.
 	if(!taskConfig.hasKey("type")) {
@@ -27,20 +31,14 @@ HueTask* HueTask::fromConfig(const HueConfig& config, const HueConfigSection &ta
 
 	std::string type = taskConfig.value("type");
 
-	#define GET_TASK_TYPE(t, c) do {\
-		if(type == t) {\
-			ret = new c(config, taskConfig, device);\
-		} \
-	} while(0)
-
-	HueTask* ret = NULL;
-	GET_TASK_TYPE("time", HueTaskTime);
-	if(ret == NULL) {
+	std::map<std::string, Factory>::const_iterator it = types().find(type);
+	if(it == types().end()) {
 		Logger::error() << "Unknown task type " << type << "\n";
 
 		return NULL;
 	}
 
+	HueTask* ret = it->second(config, taskConfig, device);
 	if(!ret->valid()) {
 		delete ret;
 		return NULL;
@@ -49,9 +47,39 @@ HueTask* HueTask::fromConfig(const HueConfig& config, const HueConfigSection &ta
 	return ret;
 }
 
+std::map<std::string, HueTask::Factory>& HueTask::types() {
+	static std::map<std::string, Factory> sTypes;
+	return sTypes;
+}
+
+bool HueTask::registerType(const std::string& type, Factory factory) {
+	return types().insert(std::make_pair(type, factory)).second;
+}
+
+uint64_t HueTask::configFingerprint(const HueConfig& config, const HueConfigSection& taskConfig) {
+	std::string id = taskConfig.value("id");
+
+	uint64_t hashes[3] = { taskConfig.hash(), 0, 0 };
+
+	HueConfigSection* stateConfig = config.getSection("Task " + id + " State");
+	if(stateConfig != NULL) {
+		hashes[1] = stateConfig->hash();
+	}
+
+	HueConfigSection* triggerConfig = config.getSection("Task " + id + " Trigger");
+	if(triggerConfig != NULL) {
+		hashes[2] = triggerConfig->hash();
+	}
+
+	return hashBytes(reinterpret_cast<const char*>(hashes), sizeof(hashes));
+}
+
 bool HueTask::update(const HueConfig& config, const HueConfigSection& taskConfig) {
 	mValid = false;
 
+	// Also when the update fails, the same config would fail again.
+	mFingerprint = configFingerprint(config, taskConfig);
+
 	if(!taskConfig.hasKey("id") || !taskConfig.hasKey("type")) {
 		return false;
 	}
@@ -79,24 +107,26 @@ bool HueTask::update(const HueConfig& config, const HueConfigSection& taskConfig
 	}
 
 	mEnabled = taskConfig.boolValue("enabled", mEnabled);
+	mCritical = taskConfig.boolValue("critical", false);
+	mRetryWindow = taskConfig.intValue("retrywindow", 300);
 	mID = taskConfig.value("id");
 	mName = taskConfig.value("name");
 	mType = taskConfig.value("type");
 
 	// lights should be a comma-separated list of light id's
-	std::set<std::string> lightIDs;
-	commaListToSet(taskConfig.value("lights"), lightIDs);
+	const std::vector<std::string>& lightList = taskConfig.listValue("lights");
+	std::set<std::string> lightIDs(lightList.begin(), lightList.end());
 
+	// A light that is missing (switched off at the wall, or removed) doesn't stop the task for the others.
+	mLightIDs.assign(lightIDs.begin(), lightIDs.end());
 	mLights.clear();
 	for(std::set<std::string>::iterator it = lightIDs.begin(); it != lightIDs.end(); ++it) {
 		HueLight* light = mDevice.light(*it);
 		if(light != NULL) {
 			mLights.push_back(light);
 		} else {
-			Logger::error() << "Task (" << mID << ") Failed to find light " << *it << ", please check your configuration!\n";
-			return false;
+			Logger::warning() << "Task (" << mID << ") Light " << *it << " is not on the hub, the task goes on without it\n";
 		}
-
 	}
 
 	mState.reset();
@@ -112,6 +142,9 @@ bool HueTask::update(const HueConfig& config, const HueConfigSection& taskConfig
 	if(stateConfig->hasKey("brightness")) {
 		mState.setBrightness(stateConfig->intValue("brightness"));
 	}
+	if(stateConfig->hasKey("transitiontime")) {
+		mState.setTransitionTime(stateConfig->intValue("transitiontime"));
+	}
 
 	if(!update(*triggerConfig)) {
 		return false;
@@ -121,10 +154,69 @@ bool HueTask::update(const HueConfig& config, const HueConfigSection& taskConfig
 	return true;
 }
 
+static bool lightBefore(const HueLight* a, const HueLight* b) {
+	return a->id() < b->id();
+}
+
+void HueTask::addLight(HueLight* light) {
+	std::vector<HueLight*>::iterator it = std::lower_bound(mLights.begin(), mLights.end(), light, lightBefore);
+	if(it != mLights.end() && *it == light) {
+		return;
+	}
+
+	mLights.insert(it, light);
+}
+
+void HueTask::removeLight(HueLight* light) {
+	std::vector<HueLight*>::iterator it = std::find(mLights.begin(), mLights.end(), light);
+	if(it != mLights.end()) {
+		mLights.erase(it);
+	}
+}
+
 void HueTask::reset() {
 
 }
 
+bool HueTask::clockChanged(time_t now) {
+	// Triggers are on whole minutes, the current one may still be due.
+	time_t from = now - (now % 60);
+
+	std::vector<time_t> times;
+	project(from, from + 400 * 24 * 3600, 1, times);
+
+	time_t expected = times.empty() ? -1 : times.front();
+	time_t current = nextTrigger();
+	if(current < from) {
+		current = -1;
+	}
+
+	if(expected == current) {
+		return false;
+	}
+
+	reset();
+	return true;
+}
+
+time_t HueTask::lastTrigger(time_t from, time_t to) const {
+	static const time_t day = 60 * 60 * 24;
+
+	// Search backwards a day at a time, the last trigger is usually close to to.
+	std::vector<time_t> times;
+	for(time_t end = to; end > from; end -= day) {
+		time_t start = std::max(from, end - day);
+
+		times.clear();
+		project(start, end, day, times);
+		if(!times.empty()) {
+			return times.back();
+		}
+	}
+
+	return -1;
+}
+
 void HueTask::generateID() {
 	std::ostringstream ret;
 	ret << std::setfill('0') << std::setw(2) << std::hex
@@ -141,9 +233,12 @@ bool HueTask::executeNow() {
 }
 
 bool HueTask::trigger() {
-	Logger::debug() << "Trigger " << mID << ", lights " << mLights.size() << "\n";
+	LOG_DEBUG() << "Trigger " << mID << ", lights " << mLights.size() << "\n";
 
 	for(std::vector<HueLight*>::const_iterator it = mLights.begin(); it != mLights.end(); ++it) {
+		// Setting a light stops any fade running on it.
+		mDevice.fades().cancel((*it)->id());
+
 		mState.copyTo((*it)->newState());
 
 		if(mStateToggle) {
@@ -163,6 +258,7 @@ json_object* HueTask::toJson() const {
 	json_object* obj = json_object_new_object();
 	json_object_object_add(obj, "id", json_object_new_string(mID.c_str()));
 	json_object_object_add(obj, "name", json_object_new_string(mName.c_str()));
+	json_object_object_add(obj, "critical", json_object_new_boolean(mCritical));
 
 	json_object* stateObj = json_object_new_object();
 
@@ -177,6 +273,9 @@ json_object* HueTask::toJson() const {
 	if(mState.isSet(HueLightState::StateSetAlert)) {
 		json_object_object_add(stateObj, "alert", json_object_new_string(mState.alert().c_str()));
 	}
+	if(mState.isSet(HueLightState::StateSetTransition)) {
+		json_object_object_add(stateObj, "transitiontime", json_object_new_int(mState.transitionTime()));
+	}
 
 	json_object_object_add(obj, "state", stateObj);
 
@@ -190,6 +289,7 @@ std::string HueTask::toString() const {
 		<< "\n" << "id=" << mID
 		<< "\n" << "name=" << mName
 		<< "\n" << "enabled=" << ((mEnabled)?"true":"false")
+		<< ((mCritical) ? "\ncritical=true" : "")
 		<< "\n" << "hub=" << mDevice.id()
 		<< "\n" << "lights=";
 
@@ -217,6 +317,9 @@ std::string HueTask::toString() const {
 	if(mState.isSet(HueLightState::StateSetAlert)) {
 		s << "\n" << "alert=" << mState.alert();
 	}
+	if(mState.isSet(HueLightState::StateSetTransition)) {
+		s << "\n" << "transitiontime=" << mState.transitionTime();
+	}
 
 	return s.str();
 }
@@ -0,0 +1,80 @@
+#include <sstream>
+#include "logger.h"
+#include "clock.h"
+#include "hue/tasks/task_fade.h"
+
+REGISTER_TASK_TYPE("fade", HueTaskFade);
+
+HueTaskFade::HueTaskFade(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device)
+	: HueTaskTime(config, taskConfig, device, false),
+	mDuration(0),
+	mFrom(-1),
+	mCurve(HueFadeEngine::CurvePerceptual)
+{
+	// Left to this constructor by the time task, so that the update reaches the fade settings as well.
+	HueTask::update(config, taskConfig);
+}
+
+bool HueTaskFade::update(const HueConfigSection& triggerConfig) {
+	if(!HueTaskTime::update(triggerConfig)) {
+		return false;
+	}
+
+	mDuration = triggerConfig.intValue("duration", 0);
+	if(mDuration <= 0) {
+		Logger::error() << "Task (" << id() << ") Fades need a duration\n";
+		return false;
+	}
+
+	mFrom = triggerConfig.intValue("from", -1);
+
+	mCurve = HueFadeEngine::CurvePerceptual;
+	if(triggerConfig.hasKey("curve") && !HueFadeEngine::curveFromString(triggerConfig.value("curve"), mCurve)) {
+		Logger::error() << "Task (" << id() << ") Unknown fade curve " << triggerConfig.value("curve") << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+bool HueTaskFade::trigger() {
+	int to = -1;
+	if(state().isSet(HueLightState::StateSetPower) && !state().on()) {
+		to = 0;
+	} else if(state().isSet(HueLightState::StateSetBrightness)) {
+		to = state().brightness();
+	}
+
+	if(to < 0) {
+		Logger::error() << "Task (" << id() << ") Nothing to fade to, set a brightness or state=off\n";
+		return false;
+	}
+
+	device().fades().start(lights(), mFrom, to, Clock::now(), mDuration, mCurve);
+	return true;
+}
+
+void HueTaskFade::toJsonInt(json_object* obj) const {
+	HueTaskTime::toJsonInt(obj);
+
+	json_object* triggerObj;
+	if(!json_object_object_get_ex(obj, "trigger", &triggerObj)) {
+		return;
+	}
+
+	json_object_object_add(triggerObj, "duration", json_object_new_int(mDuration));
+	if(mFrom >= 0) {
+		json_object_object_add(triggerObj, "from", json_object_new_int(mFrom));
+	}
+	json_object_object_add(triggerObj, "curve", json_object_new_string(HueFadeEngine::curveToString(mCurve)));
+}
+
+void HueTaskFade::toStringInt(std::ostringstream& s) const {
+	HueTaskTime::toStringInt(s);
+
+	s << "\n" << "duration=" << mDuration;
+	if(mFrom >= 0) {
+		s << "\n" << "from=" << mFrom;
+	}
+	s << "\n" << "curve=" << HueFadeEngine::curveToString(mCurve);
+}
@@ -0,0 +1,104 @@
+#include <sstream>
+#include "logger.h"
+#include "clock.h"
+#include "hue/tasks/task_interval.h"
+
+REGISTER_TASK_TYPE("interval", HueTaskInterval);
+
+HueTaskInterval::HueTaskInterval(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device)
+	: HueTask(config, taskConfig, device),
+	mInterval(0),
+	mOffset(0),
+	mNext(-1)
+{
+	HueTask::update(config, taskConfig);
+}
+
+time_t HueTaskInterval::alignedAt(time_t t) const {
+	time_t rest = (t - mOffset) % mInterval;
+	if(rest < 0) {
+		rest += mInterval;
+	}
+
+	return (rest == 0) ? t : t + (mInterval - rest);
+}
+
+bool HueTaskInterval::execute(bool& fatalError) {
+	time_t now = Clock::now();
+	if(mNext < 0 || now < mNext) {
+		return false;
+	}
+
+	// Triggers that were missed are not made up for, only the last one fires.
+	if(now - mNext >= mInterval) {
+		LOG_DEBUG() << "Task " << id() << " missed " << ((now - mNext) / mInterval) << " triggers\n";
+	}
+
+	mNext = alignedAt(now + 1);
+
+	LOG_DEBUG() << "Trigger " << id() << "!\n";
+	fatalError = !trigger();
+	return true;
+}
+
+void HueTaskInterval::reset() {
+	HueTask::reset();
+
+	updateTrigger(Clock::now());
+}
+
+void HueTaskInterval::updateTrigger(time_t now) {
+	mNext = (mInterval > 0) ? alignedAt(now) : -1;
+}
+
+time_t HueTaskInterval::nextTrigger() const {
+	return mNext;
+}
+
+void HueTaskInterval::project(time_t from, time_t to, size_t count, std::vector<time_t>& times) const {
+	if(mInterval <= 0) {
+		return;
+	}
+
+	for(time_t t = alignedAt(from); t < to && count > 0; t += mInterval, count--) {
+		times.push_back(t);
+	}
+}
+
+bool HueTaskInterval::update(const HueConfigSection& triggerConfig) {
+	int interval = triggerConfig.intValue("interval", 0);
+	if(interval <= 0) {
+		Logger::error() << "Task (" << id() << ") Intervals need to be at least a second\n";
+		return false;
+	}
+
+	int offset = triggerConfig.intValue("offset", 0);
+
+	bool changed = interval != mInterval || offset != mOffset;
+	mInterval = interval;
+	mOffset = offset;
+
+	if(changed || mNext < 0) {
+		updateTrigger(Clock::now());
+	}
+
+	return true;
+}
+
+void HueTaskInterval::toJsonInt(json_object* obj) const {
+	json_object* triggerObj = json_object_new_object();
+	json_object_object_add(triggerObj, "interval", json_object_new_int(mInterval));
+	if(mOffset != 0) {
+		json_object_object_add(triggerObj, "offset", json_object_new_int(mOffset));
+	}
+
+	json_object_object_add(obj, "trigger", triggerObj);
+}
+
+void HueTaskInterval::toStringInt(std::ostringstream& s) const {
+	s << "\n\n" << "[Task " << id() << " Trigger]";
+	s << "\n" << "interval=" << mInterval;
+	if(mOffset != 0) {
+		s << "\n" << "offset=" << mOffset;
+	}
+}
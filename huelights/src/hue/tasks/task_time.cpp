@@ -1,55 +1,68 @@
 #include <sstream>
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <unistd.h>
 #include "logger.h"
+#include "clock.h"
 #include "hue/tasks/task_time.h"
 #include "utils.h"
 #include "sunposition.h"
 
-std::map<std::string, HueTaskTime::Method> HueTaskTime::sSupportedMethods;
+static std::map<std::string, HueTaskTime::Method> createSupportedMethods() {
+	std::map<std::string, HueTaskTime::Method> methods;
+	methods.insert(std::pair<std::string, HueTaskTime::Method>("fixed", HueTaskTime::MethodFixed));
+	methods.insert(std::pair<std::string, HueTaskTime::Method>("recurring", HueTaskTime::MethodRecurring));
+	methods.insert(std::pair<std::string, HueTaskTime::Method>("cron", HueTaskTime::MethodCron));
+	return methods;
+}
+
+// Initialized up front, tasks are created from several hub threads.
+std::map<std::string, HueTaskTime::Method> HueTaskTime::sSupportedMethods = createSupportedMethods();
 
-HueTaskTime::HueTaskTime(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device)
+REGISTER_TASK_TYPE("time", HueTaskTime);
+
+HueTaskTime::HueTaskTime(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device, bool update)
 	: HueTask(config, taskConfig, device),
 	mTaskMethod(HueTaskTime::MethodNone),
 	mPosition(std::make_pair<double, double>(0.0f, 0.0f)),
-	mTimeSun(SunNone)
+	mTimeSun(SunNone),
+	mTriggerTime(-1),
+	mWeekdays(0x7F)
 {
-	if(sSupportedMethods.size() == 0) {
-		sSupportedMethods.insert(std::pair<std::string, HueTaskTime::Method>("fixed", HueTaskTime::MethodFixed));
-		sSupportedMethods.insert(std::pair<std::string, HueTaskTime::Method>("recurring", HueTaskTime::MethodRecurring));
-	}
-
 	memset(&mTime, 0xFF, sizeof(struct tm));
 
-	HueTask::update(config, taskConfig);
+	if(update) {
+		HueTask::update(config, taskConfig);
+	}
 }
 
 bool HueTaskTime::execute(bool& fatalError) {
-	time_t now;
-	time(&now);
+	time_t now = Clock::now();
 
 	int64_t diff = -1;
-	if(mTime.tm_year >= 0) {
-		diff = difftime(now, mktime(&mTime));
+	if(mTriggerTime >= 0) {
+		diff = difftime(now, mTriggerTime);
 	}
 
 	switch(mTaskMethod) {
 		case MethodFixed: {
 			if(diff >= 0 && diff < 60) {
 				Logger::info() << "Trigger " << id() << "!\n";
-				fatalError = trigger();
+				fatalError = !trigger();
 				return true;
 			}
 
 			break;
 		}
-		case MethodRecurring: {
+		case MethodRecurring:
+		case MethodCron: {
 			// Update the task time, then trigger the task.
 			if(diff >= 0 && diff < 60) {
 				updateTrigger(now);
 
 				Logger::info() << "Trigger " << id() << "!\n";
-				fatalError = trigger();
+				fatalError = !trigger();
 				return true;
 			}
 
@@ -64,42 +77,82 @@ bool HueTaskTime::execute(bool& fatalError) {
 }
 
 void HueTaskTime::updateTrigger(time_t now) {
-	if(mTaskMethod != MethodRecurring) {
+	calculateTrigger(now);
+	cacheTriggerTime();
+}
+
+void HueTaskTime::cacheTriggerTime() {
+	if(mTaskMethod == MethodNone || mTime.tm_year < 0) {
+		mTriggerTime = -1;
+		return;
+	}
+
+	struct tm triggerTm = mTime;
+	mTriggerTime = mktime(&triggerTm);
+}
+
+void HueTaskTime::calculateTrigger(time_t now) {
+	if(mTaskMethod != MethodRecurring && mTaskMethod != MethodCron) {
 		return;
 	}
 
 	bool wasSet = mTime.tm_year >= 0;
 
+	if(mTimeSun == SunNone) {
+		// A trigger that was set has just fired (or is about to), so look past the current minute. Tasks
+		// can run well into their minute, so that is taken from the start of the minute rather than from now.
+		time_t next = mCron.next(wasSet ? now - now % 60 : now - 1);
+		if(next < 0) {
+			Logger::warning() << "Task " << id() << " never triggers\n";
+			mTime.tm_year = -1;
+			return;
+		}
+
+		localtime_r(&next, &mTime);
+
+		if(Logger::enabled(LOGGER_LEVEL_DEBUG)) {
+			char buf[80];
+			strftime(buf, 80, "%Y-%m-%d %H:%M", &mTime);
+
+			LOG_DEBUG() << "Triggering " << name() << " at " << buf << "\n";
+		}
+		return;
+	}
+
 	time_t timeBefore = mktime(&mTime);
 
-	struct tm* nowTm = localtime(&now);
+	struct tm nowTm;
+	localtime_r(&now, &nowTm);
 
-	mTime.tm_year = nowTm->tm_year;
-	mTime.tm_mon = nowTm->tm_mon;
-	mTime.tm_mday = nowTm->tm_mday;
-	mTime.tm_wday = nowTm->tm_wday;
+	mTime.tm_year = nowTm.tm_year;
+	mTime.tm_mon = nowTm.tm_mon;
+	mTime.tm_mday = nowTm.tm_mday;
+	mTime.tm_wday = nowTm.tm_wday;
 	mTime.tm_sec = 0;
-	mTime.tm_yday = nowTm->tm_yday;
-	mTime.tm_isdst = nowTm->tm_isdst;
+	mTime.tm_yday = nowTm.tm_yday;
 
 	// Two weeks ahead should be enough to find a valid date (probably not necessary, but it doesn't matter).
 	for(int i = 0; i < 14; i++) {
-		if(mRepeatDays.size() == 0 || mRepeatDays.find(mTime.tm_wday) != mRepeatDays.end()) {
+		// Let mktime work out DST for each day, otherwise triggers move an hour when DST changes.
+		mTime.tm_isdst = -1;
+
+		if(mCron.matchesDay(HueCronExpression::dayNumber(mTime.tm_year + 1900, mTime.tm_mon + 1, mTime.tm_mday))) {
 			if(mTimeSun != SunNone) {
 				mTime.tm_hour = mTime.tm_min = 0;
 
 				std::pair<time_t, time_t> sunPosition;
 				SunPosition::getTimes(sunPosition, mktime(&mTime), mPosition.first, mPosition.second);
 
-				struct tm* sunTime;
+				struct tm sunTime;
 				if(mTimeSun == SunRise) {
-					sunTime = localtime(&sunPosition.first);
+					localtime_r(&sunPosition.first, &sunTime);
 				} else {
-					sunTime = localtime(&sunPosition.second);
+					localtime_r(&sunPosition.second, &sunTime);
 				}
 
-				mTime.tm_hour = sunTime->tm_hour;
-				mTime.tm_min = sunTime->tm_min;
+				mTime.tm_hour = sunTime.tm_hour;
+				mTime.tm_min = sunTime.tm_min;
+				mTime.tm_isdst = -1;
 			}
 
 			int64_t diff = difftime(now, mktime(&mTime));
@@ -119,10 +172,131 @@ void HueTaskTime::updateTrigger(time_t now) {
 		}
 	}
 
-	char buf[80];
-	strftime(buf, 80, "%Y-%m-%d %H:%M", &mTime);
+	// The time is only formatted when it's logged.
+	if(Logger::enabled(LOGGER_LEVEL_DEBUG)) {
+		char buf[80];
+		strftime(buf, 80, "%Y-%m-%d %H:%M", &mTime);
+
+		LOG_DEBUG() << "Triggering " << name() << " at " << buf << "\n";
+	}
+}
+
+time_t HueTaskTime::nextTrigger() const {
+	return mTriggerTime;
+}
+
+bool HueTaskTime::due(time_t now) const {
+	return mTriggerTime >= 0 && now >= mTriggerTime && now - mTriggerTime < 60;
+}
+
+void HueTaskTime::project(time_t from, time_t to, size_t count, std::vector<time_t>& times) const {
+	const size_t limit = times.size() + count;
+
+	switch(mTaskMethod) {
+		case MethodFixed: {
+			if(mTime.tm_year < 0) {
+				break;
+			}
+
+			struct tm fixedTm = mTime;
+			time_t fixedTime = mktime(&fixedTm);
+			if(times.size() < limit && fixedTime >= from && fixedTime < to) {
+				times.push_back(fixedTime);
+			}
+
+			break;
+		}
+		case MethodRecurring:
+		case MethodCron: {
+			if(mTimeSun == SunNone) {
+				for(time_t t = mCron.next(from - 1); t >= 0 && t < to && times.size() < limit; t = mCron.next(t)) {
+					times.push_back(t);
+				}
+
+				break;
+			}
+
+			// Collect the midnight of every matching day first, so that the sun times can be calculated in one batch.
+			std::vector<time_t> days;
+
+			struct tm dayTm;
+			localtime_r(&from, &dayTm);
+			dayTm.tm_hour = dayTm.tm_min = dayTm.tm_sec = 0;
+			dayTm.tm_isdst = -1;
+
+			for(time_t day = mktime(&dayTm); day < to; day = mktime(&dayTm)) {
+				if(mCron.matchesDay(HueCronExpression::dayNumber(dayTm.tm_year + 1900, dayTm.tm_mon + 1, dayTm.tm_mday))) {
+					days.push_back(day);
+				}
+
+				dayTm.tm_mday++;
+				dayTm.tm_hour = dayTm.tm_min = dayTm.tm_sec = 0;
+				dayTm.tm_isdst = -1;
+			}
+
+			std::vector<double> lats(days.size(), mPosition.first), lngs(days.size(), mPosition.second);
+			std::vector<time_t> rises(days.size()), sets(days.size());
+			if(days.size() > 0) {
+				SunPosition::getTimes(&days[0], &lats[0], &lngs[0], days.size(), &rises[0], &sets[0]);
+			}
+
+			const std::vector<time_t>& sunTimes = (mTimeSun == SunRise) ? rises : sets;
+			for(size_t i = 0; i < sunTimes.size() && times.size() < limit; i++) {
+				// Triggers are on whole minutes.
+				time_t t = sunTimes[i] - ((sunTimes[i] % 60) + 60) % 60;
+				if(t >= from && t < to) {
+					times.push_back(t);
+				}
+			}
+
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+bool HueTaskTime::bridgeTime(time_t now, std::string& localtime) const {
+	// The bridge knows neither the sun nor exceptions.
+	if(mTimeSun != SunNone || mCron.hasExclusions()) {
+		return false;
+	}
+
+	char buf[32];
+	switch(mTaskMethod) {
+		case MethodFixed: {
+			// Still offloaded in the minute of the trigger, so that it isn't run here as well.
+			if(mTriggerTime < 0 || mTriggerTime + 60 <= now) {
+				return false;
+			}
+
+			strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &mTime);
+			break;
+		}
+		case MethodRecurring: {
+			// The bridge has monday in the high bit and sunday in the low bit.
+			int mask = mWeekdays & 0x01;
+			for(int i = 1; i < 7; i++) {
+				if((mWeekdays & (1 << i)) != 0) {
+					mask |= 1 << (7 - i);
+				}
+			}
+
+			if(mask == 0) {
+				return false;
+			}
+
+			snprintf(buf, sizeof(buf), "W%d/T%02d:%02d:00", mask, mTime.tm_hour, mTime.tm_min);
+			break;
+		}
+		default: {
+			return false;
+		}
+	}
 
-	Logger::debug() << "Triggering " << name() << " at " << buf << "\n";
+	localtime = buf;
+	return true;
 }
 
 bool HueTaskTime::update(const HueConfigSection& triggerConfig) {
@@ -134,6 +308,8 @@ bool HueTaskTime::update(const HueConfigSection& triggerConfig) {
 	mTaskMethod = sSupportedMethods.at(m);
 
 	time_t timeBefore = mktime(&mTime);
+	std::string cronBefore = mCron.expression();
+	std::string exclusionsBefore = mCron.exclusions();
 
 	struct tm newTime;
 	memset(&newTime, 0xFF, sizeof(struct tm));
@@ -149,6 +325,7 @@ bool HueTaskTime::update(const HueConfigSection& triggerConfig) {
 			mTime.tm_mday = newTime.tm_mday;
 			mTime.tm_hour = newTime.tm_hour;
 			mTime.tm_min = newTime.tm_min;
+			mTime.tm_sec = 0;
 
 			break;
 		}
@@ -171,50 +348,90 @@ bool HueTaskTime::update(const HueConfigSection& triggerConfig) {
 			}
 
 			if(triggerConfig.hasKey("position")) {
-				std::vector<std::string> position;
-				commaListToVector(triggerConfig.value("position"), position);
+				const std::vector<std::string>& position = triggerConfig.listValue("position");
+
+				HueConfigValue latitude(position.size() > 0 ? position[0] : "");
+				HueConfigValue longitude(position.size() > 1 ? position[1] : "");
+				if(position.size() != 2 || !latitude.is(HueConfigValue::TypeDouble) || !longitude.is(HueConfigValue::TypeDouble)) {
+					Logger::error() << "Task (" << id() << ") Invalid position '" << triggerConfig.value("position") << "', expected latitude,longitude\n";
+					return false;
+				}
 
-				mPosition.first = atof(position.at(0).c_str());
-				mPosition.second = atof(position.at(1).c_str());
+				mPosition.first = latitude.toDouble();
+				mPosition.second = longitude.toDouble();
 			}
 
-			mRepeatDays.clear();
+			uint8_t weekdays = 0x7F;
 			if(triggerConfig.hasKey("days")) {
-				std::set<std::string> repeat;
-				commaListToSet(triggerConfig.value("days"), repeat);
+				const std::vector<std::string>& repeat = triggerConfig.listValue("days");
 
-				if(repeat.find("all") == repeat.end()) {
+				if(std::find(repeat.begin(), repeat.end(), "all") == repeat.end()) {
 					static std::string days[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
 
-					for(std::set<std::string>::iterator it = repeat.begin(); it != repeat.end(); ++it) {
+					weekdays = 0;
+					for(std::vector<std::string>::const_iterator it = repeat.begin(); it != repeat.end(); ++it) {
 						for(uint32_t i = 0; i < 7; i++) {
 							if(*it == days[i]) {
-								mRepeatDays.insert(i);
+								weekdays |= 1 << i;
 							}
 						}
 					}
 				}
 			}
+
+			mWeekdays = weekdays;
+
+			// Triggers on the sun only use the days.
+			if(mTimeSun == SunNone) {
+				mCron.setDaily(mTime.tm_hour, mTime.tm_min, weekdays);
+			} else {
+				mCron.setDaily(0, 0, weekdays);
+			}
+
+			break;
+		}
+		case HueTaskTime::MethodCron: {
+			mTimeSun = SunNone;
+
+			if(!mCron.parse(triggerConfig.value("cron"))) {
+				Logger::error() << "Task (" << id() << ") Invalid cron expression '" << triggerConfig.value("cron") << "'\n";
+				return false;
+			}
+
+			break;
 		}
 		default: {
 			break;
 		}
 	}
 
+	if(!mCron.parseExclusions(triggerConfig.value("exclude"))) {
+		Logger::error() << "Task (" << id() << ") Invalid exclude dates '" << triggerConfig.value("exclude") << "'\n";
+		return false;
+	}
+
 	// Only update trigger time when the time has actually changed.
 	int64_t diff = difftime(timeBefore, mktime(&mTime));
-	if(mTime.tm_year < 0 || diff != 0) {
-		updateTrigger(time(NULL));
+	if(mTime.tm_year < 0 || diff != 0 || mCron.expression() != cronBefore || mCron.exclusions() != exclusionsBefore) {
+		updateTrigger(Clock::now());
 	}
 
+	// Fixed times are taken as they are.
+	cacheTriggerTime();
+
 	return true;
 }
 
 void HueTaskTime::reset() {
 	HueTask::reset();
 
+	// Fixed tasks keep their absolute time.
+	if(mTaskMethod != MethodRecurring && mTaskMethod != MethodCron) {
+		return;
+	}
+
 	mTime.tm_year = -1;
-	updateTrigger(time(NULL));
+	updateTrigger(Clock::now());
 }
 
 void HueTaskTime::toJsonInt(json_object* obj) const {
@@ -238,6 +455,14 @@ void HueTaskTime::toJsonInt(json_object* obj) const {
 	}
 
 	json_object_object_add(triggerObj, "time", json_object_new_string(timeStr.c_str()));
+	if(mTaskMethod == MethodCron) {
+		json_object_object_add(triggerObj, "cron", json_object_new_string(mCron.expression().c_str()));
+	}
+
+	std::string exclusions = mCron.exclusions();
+	if(!exclusions.empty()) {
+		json_object_object_add(triggerObj, "exclude", json_object_new_string(exclusions.c_str()));
+	}
 
 	json_object_object_add(obj, "trigger", triggerObj);
 }
@@ -261,4 +486,13 @@ void HueTaskTime::toStringInt(std::ostringstream& s) const {
 	} else if(mTimeSun == SunSet) {
 		s << " (sunset)";
 	}
+
+	if(mTaskMethod == MethodCron) {
+		s << "\n" << "cron=" << mCron.expression();
+	}
+
+	std::string exclusions = mCron.exclusions();
+	if(!exclusions.empty()) {
+		s << "\n" << "exclude=" << exclusions;
+	}
 }
@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <set>
+#include "logger.h"
+#include "clock.h"
+#include "hue/hue.h"
+#include "hue/worker.h"
+
+HubWorker::HubWorker(const std::string& id, HueConfig& config)
+	: mID(id),
+	mConfig(config),
+	mDevice(NULL),
+	mStop(false),
+	mFinished(false),
+	mPending(false),
+	mPendingReload(false),
+	mPendingJump(0),
+	mPendingMissedSince(-1),
+	mPendingStart(0),
+	mWarmedUntil(0)
+{
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&mMutex, NULL);
+	pthread_cond_init(&mCond, &condAttr);
+
+	pthread_condattr_destroy(&condAttr);
+
+	pthread_create(&mThread, NULL, &HubWorker::threadMain, this);
+}
+
+HubWorker::~HubWorker() {
+	stop();
+	pthread_join(mThread, NULL);
+
+	pthread_cond_destroy(&mCond);
+	pthread_mutex_destroy(&mMutex);
+
+	delete mDevice;
+}
+
+void HubWorker::schedule(const std::string& ip, time_t start, time_t jump, time_t missedSince) {
+	pthread_mutex_lock(&mMutex);
+	if(mPending) {
+		Logger::warning() << "Hub " << mID << " is still busy, merging runs\n";
+	}
+
+	mPending = true;
+	mPendingJump += jump;
+	if(missedSince >= 0 && (mPendingMissedSince < 0 || missedSince < mPendingMissedSince)) {
+		mPendingMissedSince = missedSince;
+	}
+	mPendingStart = start;
+	mPendingIp = ip;
+
+	pthread_cond_signal(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+void HubWorker::reload() {
+	pthread_mutex_lock(&mMutex);
+	mPendingReload = true;
+	pthread_cond_signal(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+void HubWorker::stop() {
+	pthread_mutex_lock(&mMutex);
+	mStop = true;
+	pthread_cond_signal(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+bool HubWorker::finished() const {
+	pthread_mutex_lock(&mMutex);
+	bool finished = mFinished;
+	pthread_mutex_unlock(&mMutex);
+
+	return finished;
+}
+
+void* HubWorker::threadMain(void* arg) {
+	static_cast<HubWorker*>(arg)->run();
+	return NULL;
+}
+
+void HubWorker::run() {
+	pthread_mutex_lock(&mMutex);
+	while(!mStop) {
+		if(!mPending && mPendingReload) {
+			mPendingReload = false;
+
+			pthread_mutex_unlock(&mMutex);
+			reloadConfig();
+			pthread_mutex_lock(&mMutex);
+			continue;
+		}
+
+		if(!mPending) {
+			// Failed tasks are retried and fades are stepped in between the scheduled runs.
+			time_t wakeAt = nextWakeup();
+			if(wakeAt < 0) {
+				pthread_cond_wait(&mCond, &mMutex);
+			} else if(wakeAt > Clock::now()) {
+				// Wait on the monotonic clock, so that wall clock changes can't stretch the wait.
+				struct timespec ts;
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				ts.tv_sec += wakeAt - Clock::now();
+				pthread_cond_timedwait(&mCond, &mMutex, &ts);
+			} else {
+				pthread_mutex_unlock(&mMutex);
+				// Triggers first, the retries and fades get what they leave of the budget.
+				executeStaggered();
+				executePreciseTasks();
+				retryTasks();
+				warmUp();
+				stepFades();
+				pthread_mutex_lock(&mMutex);
+			}
+
+			continue;
+		}
+
+		std::string ip = mPendingIp;
+		time_t start = mPendingStart;
+		time_t jump = mPendingJump;
+		time_t missedSince = mPendingMissedSince;
+		mPending = false;
+		mPendingReload = false;
+		mPendingJump = 0;
+		mPendingMissedSince = -1;
+
+		pthread_mutex_unlock(&mMutex);
+		bool reached = tick(ip, start, jump, missedSince);
+		pthread_mutex_lock(&mMutex);
+
+		if(!reached) {
+			// The hub still has to hear about the jump, and about the triggers it missed (this minute's too),
+			// so they are merged into the next run.
+			mPendingJump += jump;
+			if(missedSince < 0 || missedSince > start) {
+				missedSince = start;
+			}
+			if(mPendingMissedSince < 0 || missedSince < mPendingMissedSince) {
+				mPendingMissedSince = missedSince;
+			}
+		}
+	}
+
+	mFinished = true;
+	pthread_mutex_unlock(&mMutex);
+}
+
+bool HubWorker::tick(const std::string& ip, time_t start, time_t jump, time_t missedSince) {
+	std::string name;
+	if(!Hue::getHubName(ip, name)) {
+		Logger::error() << "Failed to reach hub " << mID << " at " << ip << "\n";
+		return false;
+	}
+
+	if(mDevice == NULL) {
+		mDevice = new HubDevice(mID, ip, name, mConfig);
+	} else {
+		mDevice->update(mID, ip, name);
+	}
+
+	if(jump != 0) {
+		clockChanged(jump);
+	}
+
+	// Tasks the bridge doesn't have are run here, so nothing is lost if this fails.
+	mOffload.sync(*mDevice, Clock::now());
+
+	if(missedSince >= 0 && missedSince < start) {
+		catchUp(missedSince, start);
+	}
+
+	executeTasks();
+
+	// With what the triggers left of the budget, the lights they just wrote are left to settle anyway.
+	mReconciler.reconcile(*mDevice, Clock::now(), mDevice->reconcileWindow());
+	scheduleWarmups();
+
+	return true;
+}
+
+static bool triggeredBefore(const std::pair<time_t, HueTask*>& a, const std::pair<time_t, HueTask*>& b) {
+	return a.first < b.first;
+}
+
+void HubWorker::catchUp(time_t from, time_t to) {
+	// Further back than this, the triggers have most likely been overruled by hand anyway.
+	static const time_t maxGap = 60 * 60 * 24 * 7;
+	from = std::max(from, to - maxGap);
+
+	// The last trigger of every task, only that one matters for the parts of the state it sets.
+	std::vector<std::pair<time_t, HueTask*> > triggered;
+	for(std::vector<HueTask*>::const_iterator it = mDevice->tasks().begin(); it != mDevice->tasks().end(); ++it) {
+		if((*it)->toggles() || mOffload.offloaded((*it)->id())) {
+			continue;
+		}
+
+		time_t last = (*it)->lastTrigger(from, to);
+		if(last >= 0) {
+			triggered.push_back(std::make_pair(last, *it));
+		}
+	}
+
+	// Applied oldest first, so that later triggers override what they set and leave the rest. Later tasks
+	// win ties like they would have when executed in order.
+	std::stable_sort(triggered.begin(), triggered.end(), triggeredBefore);
+
+	std::map<HueLight*, HueLightState> latest;
+	for(std::vector<std::pair<time_t, HueTask*> >::const_iterator it = triggered.begin(); it != triggered.end(); ++it) {
+		for(std::vector<HueLight*>::const_iterator lightIt = it->second->lights().begin(); lightIt != it->second->lights().end(); ++lightIt) {
+			it->second->state().copyTo(&latest[*lightIt]);
+		}
+	}
+
+	if(latest.empty()) {
+		return;
+	}
+
+	size_t missed = triggered.size();
+
+	char buf[80];
+	struct tm fromTm;
+	localtime_r(&from, &fromTm);
+	strftime(buf, 80, "%Y-%m-%d %H:%M", &fromTm);
+
+	Logger::info() << "Catching up on " << missed << " tasks that triggered since " << buf << " on hub " << mID << "\n";
+
+	// One write per light, with the state its missed triggers add up to.
+	size_t written = 0;
+	for(std::map<HueLight*, HueLightState>::iterator it = latest.begin(); it != latest.end(); ++it) {
+		mDevice->fades().cancel(it->first->id());
+
+		it->second.clearTransitionTime();
+		it->second.copyTo(it->first->newState());
+
+		if(it->first->write(*mDevice)) {
+			written++;
+		} else {
+			Logger::warning() << "Failed to catch up light " << it->first->id() << "\n";
+		}
+	}
+
+	Logger::info() << "Caught up " << written << " of " << latest.size() << " lights\n";
+}
+
+void HubWorker::clockChanged(time_t jump) {
+	time_t now = Clock::now();
+
+	// Retry times, deadlines and spread out tasks are on the old clock.
+	mRetries.clear();
+	mReconciler.clear();
+	mOffload.invalidate();
+	mStaggered.clear();
+	mWarmups.clear();
+	mWarmedUntil = 0;
+
+	size_t count = 0;
+	for(std::vector<HueTask*>::const_iterator it = mDevice->tasks().begin(); it != mDevice->tasks().end(); ++it) {
+		if((*it)->clockChanged(now)) {
+			count++;
+		}
+	}
+
+	Logger::info() << "Clock moved " << jump << "s, recalculated " << count << " of " << mDevice->tasks().size() << " tasks on hub " << mID << "\n";
+}
+
+void HubWorker::reloadConfig() {
+	// Until the first run there is nothing to reload, the run builds the tasks from the new config.
+	if(mDevice == NULL || !mDevice->updateConfig()) {
+		return;
+	}
+
+	// The old task list may have been freed.
+	collectPreciseTasks();
+
+	Logger::info() << "Reloaded " << mDevice->tasks().size() << " tasks on hub " << mID << "\n";
+}
+
+void HubWorker::collectPreciseTasks() {
+	mPreciseTasks.clear();
+	for(std::vector<HueTask*>::const_iterator it = mDevice->tasks().begin(); it != mDevice->tasks().end(); ++it) {
+		if((*it)->precise() && !mOffload.offloaded((*it)->id())) {
+			mPreciseTasks.push_back(*it);
+		}
+	}
+}
+
+static bool criticalFirst(const HueTask* a, const HueTask* b) {
+	return a->critical() && !b->critical();
+}
+
+void HubWorker::executeTasks() {
+	collectPreciseTasks();
+
+	std::vector<HueTask*> due;
+	size_t commands = 0;
+	time_t late = 0;
+
+	time_t now = Clock::now();
+	for(std::vector<HueTask*>::const_iterator it = mDevice->tasks().begin(); it != mDevice->tasks().end(); ++it) {
+		if(mOffload.offloaded((*it)->id())) {
+			// The bridge triggers it, only its trigger time is kept moving for when it comes back.
+			if((*it)->due(now)) {
+				(*it)->updateTrigger(now);
+			}
+
+			continue;
+		}
+
+		if((*it)->due(now)) {
+			due.push_back(*it);
+			commands += std::max<size_t>(1, (*it)->lights().size());
+			late = std::max(late, now - (*it)->nextTrigger());
+		}
+	}
+
+	// Tasks are only due within the minute of their trigger, a late run leaves less room.
+	time_t spreadLimit = std::min<time_t>(mDevice->spread(), 59 - late);
+
+	// What already went out in this second, like a catch-up, counts as sent before the tasks.
+	size_t budget = mDevice->budget();
+	size_t used = budget - mDevice->commandsLeft(now);
+	if(used + commands <= budget || spreadLimit <= 0) {
+		for(std::vector<HueTask*>::const_iterator it = due.begin(); it != due.end(); ++it) {
+			executeTask(*it);
+		}
+
+		return;
+	}
+
+	// Too much for the bridge at once, critical tasks go first and the rest follow at the rate of the budget.
+	// If that takes longer than the spread window, the window is divided according to the commands of each task.
+	std::stable_sort(due.begin(), due.end(), criticalFirst);
+
+	size_t spread = spreadLimit;
+	size_t total = used + commands;
+	bool compress = (total - 1) / budget > spread;
+
+	Logger::info() << "Spreading " << due.size() << " tasks (" << commands << " commands) over "
+		<< (compress ? spread : (total - 1) / budget) << "s on hub " << mID << "\n";
+
+	size_t before = used;
+	for(std::vector<HueTask*>::const_iterator it = due.begin(); it != due.end(); ++it) {
+		time_t offset = compress ? (before * spread / total) : (before / budget);
+		before += std::max<size_t>(1, (*it)->lights().size());
+
+		if(offset == 0) {
+			executeTask(*it);
+			continue;
+		}
+
+		mStaggered.insert(std::make_pair(now + offset, (*it)->id()));
+	}
+}
+
+void HubWorker::executeStaggered() {
+	if(mDevice == NULL) {
+		mStaggered.clear();
+		return;
+	}
+
+	time_t now = Clock::now();
+	while(!mStaggered.empty() && mStaggered.begin()->first <= now) {
+		std::string id = mStaggered.begin()->second;
+		mStaggered.erase(mStaggered.begin());
+
+		HueTask* task = mDevice->task(id);
+		if(task == NULL) {
+			continue;
+		}
+
+		time_t trigger = task->nextTrigger();
+		executeTask(task);
+
+		Logger::info() << "Task " << id << " (" << task->name() << ") started " << (now - trigger) << "s after its trigger\n";
+	}
+}
+
+void HubWorker::scheduleWarmups() {
+	time_t warmup = mDevice->warmup();
+	if(warmup <= 0) {
+		mWarmups.clear();
+		return;
+	}
+
+	// Every run covers the refreshes up to the next run, continuing where the previous one stopped.
+	time_t now = Clock::now();
+	time_t from = std::max(now, mWarmedUntil);
+	mWarmedUntil = now + 60;
+
+	for(std::vector<HueTask*>::const_iterator it = mDevice->tasks().begin(); it != mDevice->tasks().end(); ++it) {
+		time_t next = (*it)->nextTrigger();
+		if(next <= now || (*it)->lights().empty() || mOffload.offloaded((*it)->id())) {
+			continue;
+		}
+
+		time_t at = next - warmup;
+		if(at >= from && at < mWarmedUntil) {
+			mWarmups.insert(std::make_pair(at, (*it)->id()));
+		}
+	}
+}
+
+void HubWorker::warmUp() {
+	if(mDevice == NULL) {
+		mWarmups.clear();
+		return;
+	}
+
+	// The lights of all tasks warming up together are refreshed once, which also opens the connection to the hub
+	// so that only the writes are left when the tasks trigger.
+	std::set<HueLight*> lights;
+
+	time_t now = Clock::now();
+	while(!mWarmups.empty() && mWarmups.begin()->first <= now) {
+		HueTask* task = mDevice->task(mWarmups.begin()->second);
+		mWarmups.erase(mWarmups.begin());
+
+		if(task != NULL) {
+			lights.insert(task->lights().begin(), task->lights().end());
+		}
+	}
+
+	if(lights.empty()) {
+		return;
+	}
+
+	size_t refreshed = 0;
+	for(std::set<HueLight*>::const_iterator it = lights.begin(); it != lights.end(); ++it) {
+		if(mDevice->refreshLight(*it)) {
+			refreshed++;
+		}
+	}
+
+	LOG_DEBUG() << "Refreshed " << refreshed << " of " << lights.size() << " lights ahead of their triggers on hub " << mID << "\n";
+}
+
+void HubWorker::executePreciseTasks() {
+	time_t now = Clock::now();
+	for(std::vector<HueTask*>::const_iterator it = mPreciseTasks.begin(); it != mPreciseTasks.end(); ++it) {
+		time_t next = (*it)->nextTrigger();
+		if(next >= 0 && next <= now) {
+			executeTask(*it);
+		}
+	}
+}
+
+void HubWorker::executeTask(HueTask* task) {
+	bool error = false;
+	if(!task->execute(error)) {
+		return;
+	}
+
+	// A new trigger replaces any retries of the previous one.
+	mRetries.remove(task->id());
+
+	time_t now = Clock::now();
+	if(error && !mRetries.failed(task->id(), now, now + task->retryWindow())) {
+		Logger::error() << "Task " << task->id() << " failed, not retrying\n";
+	}
+}
+
+time_t HubWorker::nextWakeup() const {
+	time_t ret = mRetries.next();
+	if(mDevice == NULL) {
+		return ret;
+	}
+
+	time_t fadeAt = mDevice->fades().next();
+	if(ret < 0 || (fadeAt >= 0 && fadeAt < ret)) {
+		ret = fadeAt;
+	}
+
+	for(std::vector<HueTask*>::const_iterator it = mPreciseTasks.begin(); it != mPreciseTasks.end(); ++it) {
+		time_t next = (*it)->nextTrigger();
+		if(ret < 0 || (next >= 0 && next < ret)) {
+			ret = next;
+		}
+	}
+
+	if(!mStaggered.empty() && (ret < 0 || mStaggered.begin()->first < ret)) {
+		ret = mStaggered.begin()->first;
+	}
+
+	if(!mWarmups.empty() && (ret < 0 || mWarmups.begin()->first < ret)) {
+		ret = mWarmups.begin()->first;
+	}
+
+	return ret;
+}
+
+void HubWorker::stepFades() {
+	if(mDevice == NULL) {
+		return;
+	}
+
+	mDevice->fades().step(*mDevice, Clock::now());
+}
+
+void HubWorker::retryTasks() {
+	if(mDevice == NULL) {
+		mRetries.clear();
+		return;
+	}
+
+	std::string id;
+	while(mDevice->commandsLeft(Clock::now()) > 0 && mRetries.pop(Clock::now(), id)) {
+		HueTask* task = mDevice->task(id);
+		if(task == NULL) {
+			mRetries.remove(id);
+			continue;
+		}
+
+		int attempts = mRetries.attempts(id);
+		Logger::info() << "Retrying task " << id << " (attempt " << attempts << ")\n";
+
+		if(task->executeNow()) {
+			mRetries.remove(id);
+		} else if(!mRetries.failed(id, Clock::now(), 0)) {
+			Logger::error() << "Task " << id << " failed after " << attempts << " retries, giving up\n";
+		}
+	}
+
+	// Out of budget, the rest waits for the next second.
+	if(mDevice->commandsLeft(Clock::now()) == 0) {
+		mRetries.postpone(Clock::now());
+	}
+}
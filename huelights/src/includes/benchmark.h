@@ -0,0 +1,20 @@
+#ifndef INCLUDES_BENCHMARK_H
+#define INCLUDES_BENCHMARK_H
+
+#include <string>
+
+class Benchmark {
+public:
+	static bool run(const std::string& type);
+
+private:
+	Benchmark();
+
+	static bool runSun();
+	static bool runDispatch();
+	static bool runConfig();
+	static bool runStartup();
+	static bool runLogging();
+};
+
+#endif //INCLUDES_BENCHMARK_H
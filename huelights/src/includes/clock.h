@@ -0,0 +1,37 @@
+#ifndef INCLUDES_CLOCK_H
+#define INCLUDES_CLOCK_H
+
+#include <ctime>
+
+// Wall clock used by the scheduler, can be replaced by a virtual time for simulations.
+class Clock {
+public:
+	static time_t now() {
+		if(sVirtual) {
+			return sTime;
+		}
+
+		return time(NULL);
+	}
+
+	static bool isVirtual() {
+		return sVirtual;
+	}
+
+	static void setTime(time_t t) {
+		sVirtual = true;
+		sTime = t;
+	}
+
+	static void reset() {
+		sVirtual = false;
+	}
+
+private:
+	Clock();
+
+	static bool sVirtual;
+	static time_t sTime;
+};
+
+#endif //INCLUDES_CLOCK_H
@@ -5,8 +5,22 @@
 
 #include <json-c/json.h>
 
+// Replaces the HTTP requests below, used to run against a simulated bridge.
+class Transport {
+public:
+	virtual ~Transport() {}
+
+	virtual bool downloadJson(const std::string& url, json_object** output) = 0;
+	virtual bool postJson(const std::string& url, json_object* input, json_object** output) = 0;
+	virtual bool putJson(const std::string& url, json_object* input, json_object** output) = 0;
+	virtual bool deleteJson(const std::string& url, json_object** output) = 0;
+};
+
+void setTransport(Transport* transport);
+
 bool downloadJson(std::string url, json_object** output);
 bool postJson(std::string url, json_object* input, json_object** output);
 bool putJson(std::string url, json_object* input, json_object** output);
+bool deleteJson(std::string url, json_object** output);
 
 #endif //INCLUDES_CONNECTION_H
@@ -5,6 +5,8 @@
 #include <vector>
 #include <map>
 #include <cstdlib>
+#include <stdint.h>
+#include <pthread.h>
 
 class HueConfigSection;
 
@@ -13,23 +15,170 @@ public:
 	HueConfig(const std::string &path);
 	~HueConfig();
 
-	HueConfigSection* getSection(const std::string& name, std::string key = "", std::string value = "") const;
-	const std::vector<HueConfigSection*> getSections(const std::string& name, std::string key = "", std::string value = "") const;
+	// Sections by name, and optionally by a key (with any value if value is empty), in the order of the file.
+	HueConfigSection* getSection(const std::string& name, const std::string& key = "", const std::string& value = "") const;
+	const std::vector<HueConfigSection*>& getSections(const std::string& name, const std::string& key = "", const std::string& value = "") const;
 
 	HueConfigSection* newSection(const std::string& name);
 
 	bool parse(bool& parseFailure);
+
+	// Only sections that changed since the file was read are written out again, the rest of the file keeps its
+	// bytes and comments. The file is replaced through a rename, so it is either the old or the new one.
 	bool write();
 
+	const std::string& path() const {
+		return mPath;
+	}
+
+	// Whether parse goes through the snapshot cache, on by default.
+	void setSnapshots(bool snapshots) {
+		mSnapshots = snapshots;
+	}
+
+	// Changes whenever sections or values do, so that users can tell whether their copies are still current.
+	unsigned long generation() const {
+		return mGeneration;
+	}
+
+	// Sections must only be accessed with the lock held when the config is shared between threads.
+	void readLock() const;
+	void writeLock() const;
+	void unlock() const;
+
 private:
+	friend class HueConfigSection;
+
+	typedef std::vector<HueConfigSection*> SectionList;
+
+	struct KeyIndex {
+		SectionList sections;
+		std::map<std::string, SectionList> values;
+	};
+
+	struct NameIndex {
+		SectionList sections;
+
+		// Only for the keys that have been looked up, most keys never are.
+		std::map<std::string, KeyIndex> keys;
+	};
+
+	const KeyIndex& keyIndex(const NameIndex& nameIndex, const std::string& key) const;
+
+	// Kept up to date by the sections when their values change.
+	void indexValue(HueConfigSection* section, const std::string& key, const std::string& value);
+	void unindexValue(HueConfigSection* section, const std::string& key, const std::string& value);
+
+	static void insertSorted(SectionList& sections, HueConfigSection* section);
+	static void erase(SectionList& sections, HueConfigSection* section);
+
+	// Sections are created straight from the mapped file, lines are only turned into strings once stored.
+	bool parseBuffer(const char* data, size_t size);
+	void parseError(size_t line, const char* message) const;
+	void clearSections();
+
+	// A changed section, merged into its lines from the file so that the comments and the order of the keys stay.
+	void writeSection(std::string& out, const HueConfigSection& section, const char* data, size_t size) const;
+
+	// The parsed sections are cached in a binary snapshot next to the file, which is used for as long as
+	// the file hashes the same. It is only a cache, a snapshot that can't be used is simply replaced.
+	std::string snapshotPath() const;
+	bool loadSnapshot(uint64_t sourceHash, uint64_t sourceSize);
+	void writeSnapshot(uint64_t sourceHash, uint64_t sourceSize) const;
+
 	std::string mPath;
 	std::vector<HueConfigSection* > mSections;
+	unsigned long mGeneration;
+	bool mSnapshots;
+
+	// The file as it was parsed or last written, sections know where they are in it.
+	uint64_t mSourceHash;
+	size_t mSourceSize;
+	bool mHasSource;
+
+	mutable std::map<std::string, NameIndex> mIndex;
+
+	// Key indexes and lists are built on their first lookup, which can happen from several threads holding the read lock.
+	mutable pthread_mutex_t mIndexLock;
+
+	mutable pthread_rwlock_t mLock;
+};
 
+class HueConfigLock {
+public:
+	HueConfigLock(const HueConfig& config, bool write = false)
+		: mConfig(config)
+	{
+		if(write) {
+			mConfig.writeLock();
+		} else {
+			mConfig.readLock();
+		}
+	}
+
+	~HueConfigLock() {
+		mConfig.unlock();
+	}
+
+private:
+	const HueConfig& mConfig;
+};
+
+// A value as written in the file, along with what it reads as. Numbers and booleans are recognized
+// when the value is set, lists are split on their first use.
+class HueConfigValue {
+public:
+	enum Type {
+		TypeBool = 0x01,
+		TypeInt = 0x02,
+		TypeDouble = 0x04,
+	};
+
+	explicit HueConfigValue(const std::string& text = "");
+
+	const std::string& text() const {
+		return mText;
+	}
+
+	bool is(Type type) const {
+		return (mTypes & type) != 0;
+	}
+
+	bool toBool() const {
+		return mNumber != 0;
+	}
+
+	int toInt() const {
+		return (int)mNumber;
+	}
+
+	double toDouble() const {
+		return mNumber;
+	}
+
+	bool operator==(const HueConfigValue& other) const {
+		return mText == other.mText;
+	}
+
+	bool operator!=(const HueConfigValue& other) const {
+		return mText != other.mText;
+	}
+
+private:
+	friend class HueConfigSection;
+
+	std::string mText;
+	double mNumber;
+	uint8_t mTypes;
+
+	// The comma separated items, once mListed is set.
+	mutable std::vector<std::string> mList;
+	mutable bool mListed;
 };
 
 class HueConfigSection {
 public:
-	typedef std::map<std::string, std::string> KeyMap;
+	typedef std::map<std::string, HueConfigValue> KeyMap;
 
 	HueConfigSection(std::string name = "");
 
@@ -41,37 +190,57 @@ public:
 		return mValues.end();
 	}
 
-	bool hasKey(const std::string &key, std::string value = "") const;
+	bool hasKey(const std::string &key, const std::string& value = "") const;
 
 	const std::string &name() const {
 		return mName;
 	}
 
-	std::string value(const std::string &key, std::string def = "") const;
-
-	bool boolValue(const std::string& key, bool def = false) const {
-		if(!hasKey(key)) {
-			return def;
-		}
+	// The position of the section in its config.
+	size_t order() const {
+		return mOrder;
+	}
 
-		return value(key) == "true";
+	// A hash of the name and values, independent of the order of the keys. Kept up to date as values change.
+	uint64_t hash() const {
+		return mHash;
 	}
 
-	int intValue(const std::string &key, int def = 0) const {
-		if(!hasKey(key)) {
-			return def;
-		}
+	// The reference is only valid until the value changes, and def has to outlive it as well.
+	const std::string& value(const std::string &key) const;
+	const std::string& value(const std::string &key, const std::string& def) const;
 
-		return atoi(value(key).c_str());
-	}
+	// A value that doesn't read as the type is reported and def is used instead.
+	bool boolValue(const std::string& key, bool def = false) const;
+	int intValue(const std::string &key, int def = 0) const;
+	double doubleValue(const std::string &key, double def = 0) const;
+
+	// The non-empty items of a comma separated value, empty if the key isn't set.
+	const std::vector<std::string>& listValue(const std::string& key) const;
 
 	void setValue(const std::string& key, const std::string& value);
 
-	bool parse(const std::string& content);
+	// For the parser, a key that is already set keeps its first value.
+	void addValue(const char* key, size_t keyLength, const char* value, size_t valueLength);
 
 private:
+	friend class HueConfig;
+
+	const HueConfigValue* find(const std::string& key) const;
+	void invalidValue(const std::string& key, const HueConfigValue& value, const char* expected) const;
+
 	std::string mName;
-	std::map<std::string, std::string> mValues;
+	KeyMap mValues;
+	uint64_t mHash;
+
+	// The config that indexes the section and its position in it, NULL for sections on their own.
+	HueConfig* mConfig;
+	size_t mOrder;
+
+	// Where the section is in the file, a length of 0 for sections that aren't in it yet.
+	size_t mSourceOffset;
+	size_t mSourceLength;
+	bool mDirty;
 }; 
 
 #endif //INCLUDES_HUE_CONFIG_H
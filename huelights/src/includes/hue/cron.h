@@ -0,0 +1,65 @@
+#ifndef INCLUDES_HUE_CRON_H
+#define INCLUDES_HUE_CRON_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <stdint.h>
+
+// A cron expression (minute hour day-of-month month weekday) compiled to bitmasks,
+// with a list of dates on which it never matches.
+class HueCronExpression {
+public:
+	// Matches every minute.
+	HueCronExpression();
+
+	bool parse(const std::string& expr);
+
+	// Comma-separated YYYY-MM-DD dates.
+	bool parseExclusions(const std::string& dates);
+
+	// Once a day at hour:minute, on the weekdays in the mask (bit 0 is sunday).
+	void setDaily(int hour, int minute, uint8_t weekdays = 0x7F);
+
+	bool matchesDay(int32_t day) const;
+
+	// The first matching time after after, or -1 if there is none within a few years.
+	time_t next(time_t after) const;
+
+	const std::string& expression() const {
+		return mExpression;
+	}
+
+	std::string exclusions() const;
+
+	bool hasExclusions() const {
+		return !mExcluded.empty();
+	}
+
+	// Days since 1970-01-01 in the proleptic gregorian calendar, and back.
+	static int32_t dayNumber(int year, int month, int mday);
+	static void civilDate(int32_t day, int& year, int& month, int& mday);
+
+	static int weekday(int32_t day) {
+		return (int)(((day % 7) + 11) % 7);
+	}
+
+private:
+	static bool parseField(const std::string& field, int min, int max, const char* const* names, uint64_t& mask);
+
+	std::string mExpression;
+
+	uint64_t mMinutes;
+	uint32_t mHours;
+	uint32_t mDays;
+	uint16_t mMonths;
+	uint8_t mWeekdays;
+
+	// Cron matches either day field when both are restricted.
+	bool mDayOr;
+
+	// Sorted day numbers.
+	std::vector<int32_t> mExcluded;
+};
+
+#endif //INCLUDES_HUE_CRON_H
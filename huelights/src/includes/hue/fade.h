@@ -0,0 +1,86 @@
+#ifndef INCLUDES_HUE_FADE_H
+#define INCLUDES_HUE_FADE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+
+class HubDevice;
+class HueLight;
+class HueLightState;
+
+// Runs the brightness fades of one hub, sending intermediate states with a transition time
+// so that the bridge smooths out the steps. Lights that fade together are sent one command
+// through a temporary group of them on the bridge. Keeps within the budget of the hub.
+class HueFadeEngine {
+public:
+	enum Curve {
+		CurveLinear = 0,
+		CurvePerceptual,
+	};
+
+	HueFadeEngine(int budget = 10);
+
+	void setBudget(int budget);
+
+	// Fade lights to brightness over duration seconds, from is the starting brightness or -1 for the current one.
+	// A brightness of 0 turns the light off at the end. A new fade on a light replaces the previous one.
+	void start(const std::vector<HueLight*>& lights, int from, int to, time_t start, int duration, Curve curve);
+	void cancel(const std::string& lightID);
+
+	// The time of the next step, or -1 if there are no fades.
+	time_t next() const;
+
+	// Send the steps that are due, returns the number of commands sent.
+	size_t step(const HubDevice& device, time_t now);
+
+	bool empty() const {
+		return mFades.empty();
+	}
+
+	size_t size() const {
+		return mFades.size();
+	}
+
+	static bool curveFromString(const std::string& str, Curve& curve);
+	static const char* curveToString(Curve curve);
+
+private:
+	struct Fade {
+		int from;
+		int to;
+		time_t start;
+		time_t end;
+		Curve curve;
+
+		time_t nextAt;
+		int sent;
+	};
+
+	typedef std::map<std::string, Fade>::iterator FadeIt;
+
+	int brightnessAt(const Fade& fade, time_t t) const;
+	time_t interval() const;
+
+	// Sends the step of fades that send the same commands, returns the number of commands sent.
+	size_t stepTogether(const HubDevice& device, time_t now, time_t stepInterval, const std::vector<FadeIt>& fades);
+
+	bool writeGroup(const HubDevice& device, const std::vector<FadeIt>& fades, const HueLightState& state, time_t now);
+	std::string group(const HubDevice& device, const std::vector<std::string>& ids, time_t now);
+	void removeGroups(const HubDevice& device, time_t now);
+
+	static bool stepsBefore(const FadeIt& a, const FadeIt& b);
+	static int toLevel(int brightness);
+
+	int mBudget;
+
+	// By light id, so that overlapping fades on a light are merged into a single stream of commands.
+	std::map<std::string, Fade> mFades;
+
+	// The bridge groups of lights fading together, by the ids of the lights. Empty if the bridge refused the group.
+	std::map<std::vector<std::string>, std::string> mGroups;
+	time_t mGroupSecond;
+};
+
+#endif //INCLUDES_HUE_FADE_H
@@ -3,11 +3,13 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include <json-c/json.h>
 #include "config.h"
 
 class HueLight;
 class HueTask;
+class HueFadeEngine;
 
 class HubDevice {
 public:
@@ -16,7 +18,13 @@ public:
 
 	bool authorize(bool& retry);
 
+	// The full list of lights is only downloaded every refreshInterval() seconds, in between
+	// the lights of upcoming triggers are refreshed on their own with refreshLight.
 	bool update(const std::string &id, const std::string &ip, const std::string &name);
+	bool refreshLight(HueLight* light);
+
+	// Rebuilds the tasks when the config changed since they were last built, returns whether it did.
+	bool updateConfig();
 
 	const std::vector<HueLight*> &lights() const {
 		return mLights;
@@ -30,9 +38,17 @@ public:
 		return mConfig;
 	}
 
+	// Fades are started by tasks, which only get a const device.
+	HueFadeEngine& fades() const {
+		return *mFades;
+	}
+
 	HueLight* light(const std::string& id) const;
 	HueTask* task(const std::string& id) const;
 
+	// The tasks configured with a light, whether the hub has the light right now or not. In the order of the config.
+	const std::vector<HueTask*>& lightTasks(const std::string& id) const;
+
 	bool isAuthorized() const {
 		return mUser.size() > 0;
 	}
@@ -53,6 +69,46 @@ public:
 		return mUser;
 	}
 
+	// How many commands per second the bridge is sent, and the window in seconds
+	// that tasks triggering at the same time are spread over when they need more.
+	int budget() const {
+		return mBudget;
+	}
+
+	int spread() const {
+		return mSpread;
+	}
+
+	// What is left of the budget in the second of now. Every write counts, whether it comes from a task,
+	// a retry, the reconciler or a fade, and so do the reads of the reconciler.
+	size_t commandsLeft(time_t now) const;
+	void countCommands(time_t now, size_t commands = 1) const;
+
+	// How many seconds before a trigger its lights are refreshed, 0 if they aren't.
+	int warmup() const {
+		return mWarmup;
+	}
+
+	// How long a written state is held on to when the hub doesn't have it, 0 if it isn't.
+	int reconcileWindow() const {
+		return mReconcile;
+	}
+
+	// Whether tasks the bridge can run by itself are handed to it as schedules,
+	// and how often those schedules are checked.
+	bool offload() const {
+		return mOffload;
+	}
+
+	int verifyInterval() const {
+		return mVerify;
+	}
+
+	// Without warm-ups nothing else keeps the lights fresh, so they are downloaded on every update.
+	int refreshInterval() const {
+		return (mWarmup > 0) ? mRefresh : 0;
+	}
+
 	json_object* toJson() const;
 	std::string toString() const;
 
@@ -65,8 +121,11 @@ public:
 	}
 
 protected:
+	void loadSettings();
 	bool updateLights();
+	void logRefreshStats(time_t now);
 	bool updateTasks();
+	unsigned long configGeneration() const;
 
 private:
 	HueConfig& mConfig;
@@ -77,9 +136,39 @@ private:
 
 	std::string mUser;
 
+	int mBudget;
+	int mSpread;
+	int mWarmup;
+	int mRefresh;
+	int mReconcile;
+	bool mOffload;
+	int mVerify;
+
+	time_t mLastRefresh;
+
+	// The commands sent in the second of mBudgetSecond.
+	mutable time_t mBudgetSecond;
+	mutable size_t mBudgetUsed;
+
+	// The config generation the tasks were built from.
+	unsigned long mConfigGeneration;
+
+	// For the hourly summary of what the targeted refreshes saved.
+	time_t mStatsStart;
+	size_t mLightsBytes;
+	size_t mFullRefreshes;
+	size_t mSkippedRefreshes;
+	size_t mLightRefreshes;
+	size_t mLightBytes;
+
 	std::vector<HueLight*> mLights;
 	std::vector<HueTask*> mTasks;
 
+	// Tasks by the uniqueid of the lights in their config, so that lights that come and go only touch their own tasks.
+	std::map<std::string, std::vector<HueTask*> > mLightTasks;
+
+	HueFadeEngine* mFades;
+
 };
 
 #endif //INCLUDES_HUE_HUB_H
@@ -6,9 +6,17 @@
 #include "hue/light.h"
 #include "hue/hub.h"
 #include "hue/task.h"
+#include "hue/fade.h"
+#include "hue/schedule.h"
+#include "hue/simulation.h"
+#include "hue/worker.h"
 
 class Hue {
 public:
+	// Lists the (id, ip) of the hubs on the network.
+	static bool discoverHubs(std::vector<std::pair<std::string, std::string> >& hubs);
+	static bool getHubName(const std::string& ip, std::string& name);
+
 	static HubDevice* getHubDevice(const std::string& id, HueConfig& config);
 	static bool getHubDevices(std::vector<HubDevice *> &devices, HueConfig& config);
 
@@ -15,6 +15,7 @@ public:
 		StateSetPower = 0x01,
 		StateSetBrightness = 0x02,
 		StateSetAlert = 0x04,
+		StateSetTransition = 0x08,
 	};
 
 	HueLightState();
@@ -29,7 +30,11 @@ public:
 		return (mStates & state) != 0;
 	}
 
-	void copyTo(HueLightState* other);
+	// Sets the parts of other that are set here.
+	void copyTo(HueLightState* other) const;
+
+	// The body of a state write, with the parts that are set.
+	json_object* toJson() const;
 
 	bool on() const {
 		return mOn;
@@ -43,6 +48,10 @@ public:
 	bool reachable() const {
 		return mReachable;
 	}
+	// In steps of 100ms, only sent along with a write.
+	int transitionTime() const {
+		return mTransitionTime;
+	}
 
 	void setOn(bool on = true) {
 		mOn = on;
@@ -60,13 +69,27 @@ public:
 		mAlert = alert;
 		mStates |= StateSetAlert;
 	}
+	void setTransitionTime(int transitionTime) {
+		mTransitionTime = transitionTime;
+		mStates |= StateSetTransition;
+	}
+	void clearTransitionTime() {
+		mStates &= ~StateSetTransition;
+	}
 
 	void reset() {
 		mStates = 0;
 	}
 
+	// The transition time isn't part of the state of the light.
 	bool operator==(const HueLightState& other) const {
-		return mStates == other.mStates;
+		if((mStates & ~StateSetTransition) != (other.mStates & ~StateSetTransition)) {
+			return false;
+		}
+
+		return (!isSet(StateSetPower) || mOn == other.mOn)
+			&& (!isSet(StateSetBrightness) || mBrightness == other.mBrightness)
+			&& (!isSet(StateSetAlert) || mAlert == other.mAlert);
 	}
 
 	bool operator!=(const HueLightState& other) const {
@@ -82,6 +105,7 @@ private:
 	int mBrightness;
 	std::string mAlert;
 	bool mReachable;
+	int mTransitionTime;
 };
 
 class HueLight {
@@ -92,6 +116,12 @@ public:
 	void update(json_object* lightObj, int index);
 	bool write(const HubDevice& device);
 
+	// The new state was written some other way, like to a group of lights.
+	void written();
+
+	// Fetch just the state of this light from the hub, bytes is set to the size of the response.
+	bool refresh(const HubDevice& device, size_t* bytes = NULL);
+
 	bool valid() const {
 		return mValid;
 	}
@@ -100,6 +130,11 @@ public:
 		return mID;
 	}
 
+	// The number of the light on its hub.
+	int index() const {
+		return mIndex;
+	}
+
 	const std::string &name() const {
 		return mName;
 	}
@@ -115,6 +150,27 @@ public:
 
 		return mNewState;
 	}
+
+	// The power and brightness the writes asked for, until the hub is seen to have them. NULL if there is nothing pending.
+	const HueLightState* desired() const {
+		return mDesired;
+	}
+	// When the desired state last changed, and when it was last written.
+	time_t desiredAt() const {
+		return mDesiredAt;
+	}
+	time_t writtenAt() const {
+		return mWrittenAt;
+	}
+	void clearDesired();
+
+	// When the state was last read from the hub.
+	time_t observedAt() const {
+		return mObservedAt;
+	}
+
+	// Whether the state read from the hub has the desired power and brightness.
+	bool hasDesired() const;
 	json_object* toJson() const;
 	std::string toString() const;
 
@@ -127,11 +183,19 @@ public:
 	}
 
 private:
+	void setDesired(const HueLightState& state);
+	void acceptNewState();
+
 	bool mValid;
 
 	HueLightState* mState;
 	HueLightState* mNewState;
 
+	HueLightState* mDesired;
+	time_t mDesiredAt;
+	time_t mWrittenAt;
+	time_t mObservedAt;
+
 	int mIndex;
 	std::string mType;
 	std::string mName;
@@ -0,0 +1,65 @@
+#ifndef INCLUDES_HUE_OFFLOAD_H
+#define INCLUDES_HUE_OFFLOAD_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <ctime>
+#include <stdint.h>
+
+class HubDevice;
+
+// Hands the tasks a bridge can run by itself over to it as schedules, one for every light of a task.
+// Schedules are recognized by their description, which holds a hash of everything in them, so that
+// a sync only deletes and creates the schedules of the tasks that changed.
+class HueScheduleOffload {
+public:
+	HueScheduleOffload();
+
+	// Bring the schedules on the bridge in line with the tasks of device. The bridge is only asked when the tasks
+	// have changed or when the schedules are due to be verified. Returns false if the bridge couldn't be reached.
+	bool sync(HubDevice& device, time_t now);
+
+	// Whether the bridge has all schedules of the task, so that it isn't run here.
+	bool offloaded(const std::string& taskID) const {
+		return mOffloaded.count(taskID) != 0;
+	}
+
+	size_t size() const {
+		return mOffloaded.size();
+	}
+
+	// Verify the schedules on the next sync.
+	void invalidate() {
+		mSyncedAt = -1;
+	}
+
+private:
+	struct Schedule {
+		std::string description;
+		std::string name;
+		std::string address;
+		std::string localtime;
+		std::string body;
+		bool recurring;
+	};
+
+	typedef std::vector<std::pair<std::string, std::vector<Schedule> > > TaskSchedules;
+
+	void collect(const HubDevice& device, time_t now, TaskSchedules& tasks) const;
+	bool create(const HubDevice& device, const Schedule& schedule, std::string& id) const;
+	bool remove(const HubDevice& device, const std::string& id) const;
+
+	static uint64_t hash(const std::string& str, uint64_t h);
+
+	uint64_t mFingerprint;
+	time_t mSyncedAt;
+
+	// Whether schedules of ours may be on the bridge. Schedules left behind by an earlier run are
+	// only removed if this starts out true.
+	bool mOwnsSchedules;
+
+	std::set<std::string> mOffloaded;
+};
+
+#endif //INCLUDES_HUE_OFFLOAD_H
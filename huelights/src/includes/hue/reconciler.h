@@ -0,0 +1,39 @@
+#ifndef INCLUDES_HUE_RECONCILER_H
+#define INCLUDES_HUE_RECONCILER_H
+
+#include <string>
+#include <map>
+#include <ctime>
+
+class HubDevice;
+
+// Brings lights back to the state they were last written, when the hub turns out not to have it.
+// Written lights are read back once, and only the power and brightness that differ are written again,
+// with a backoff between attempts. A desired state is given up on once it is older than the window.
+class HueReconciler {
+public:
+	HueReconciler(int settle = 10, int baseDelay = 15, int maxDelay = 120);
+
+	// Check the lights of device with what is left of its budget for now. Returns the number of requests sent.
+	size_t reconcile(HubDevice& device, time_t now, time_t window);
+
+	void clear();
+
+private:
+	struct Attempt {
+		int attempts;
+		time_t nextAt;
+	};
+
+	void backoff(const std::string& id, time_t now);
+
+	// Recently written lights are left alone, the hub (or a fade) may not be done with them yet.
+	int mSettle;
+	int mBaseDelay;
+	int mMaxDelay;
+
+	// By light id, only for lights that needed more than one look.
+	std::map<std::string, Attempt> mAttempts;
+};
+
+#endif //INCLUDES_HUE_RECONCILER_H
@@ -0,0 +1,51 @@
+#ifndef INCLUDES_HUE_RETRY_H
+#define INCLUDES_HUE_RETRY_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <ctime>
+
+// Failed tasks waiting to be retried, with exponential backoff and jitter.
+// A task is given up on once its retry deadline has passed.
+class HueRetryQueue {
+public:
+	HueRetryQueue(int baseDelay = 2, int maxDelay = 60);
+
+	// Schedule a retry, the deadline is only taken from the first failure.
+	// Returns false if the deadline has passed and the task was dropped.
+	bool failed(const std::string& id, time_t now, time_t deadline);
+	void remove(const std::string& id);
+	void clear();
+
+	// The time of the earliest retry, or -1 if the queue is empty.
+	time_t next() const;
+
+	// Take the next retry that is due at now.
+	bool pop(time_t now, std::string& id);
+
+	// Move the retries that are due at now to the second after it.
+	void postpone(time_t now);
+
+	int attempts(const std::string& id) const;
+
+	bool empty() const {
+		return mEntries.empty();
+	}
+
+private:
+	struct Entry {
+		int attempts;
+		time_t retryAt;
+		time_t deadline;
+	};
+
+	int mBaseDelay;
+	int mMaxDelay;
+	unsigned int mSeed;
+
+	std::map<std::string, Entry> mEntries;
+	std::set<std::pair<time_t, std::string> > mQueue;
+};
+
+#endif //INCLUDES_HUE_RETRY_H
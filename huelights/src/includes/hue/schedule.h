@@ -0,0 +1,40 @@
+#ifndef INCLUDES_HUE_SCHEDULE_H
+#define INCLUDES_HUE_SCHEDULE_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <json-c/json.h>
+
+class HubDevice;
+class HueTask;
+
+// Projects the upcoming triggers of tasks without modifying them.
+class HueSchedule {
+public:
+	struct Entry {
+		const HueTask* task;
+		std::vector<time_t> times;
+	};
+
+	HueSchedule(time_t from, time_t to, size_t count);
+
+	void project(const HubDevice& device);
+	void project(const std::vector<HubDevice*>& devices);
+
+	const std::vector<Entry>& entries() const {
+		return mEntries;
+	}
+
+	json_object* toJson() const;
+	std::string toString() const;
+
+private:
+	time_t mFrom;
+	time_t mTo;
+	size_t mCount;
+
+	std::vector<Entry> mEntries;
+};
+
+#endif //INCLUDES_HUE_SCHEDULE_H
@@ -0,0 +1,88 @@
+#ifndef INCLUDES_HUE_SIMULATION_H
+#define INCLUDES_HUE_SIMULATION_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <json-c/json.h>
+#include "connection.h"
+#include "logger.h"
+
+class HueConfig;
+
+// A stand-in for the bridges in the config file, lights are created for every light referenced by a task.
+// Schedules are stored, but not run.
+class SimulatedTransport : public Transport {
+public:
+	SimulatedTransport(const HueConfig& config);
+
+	virtual bool downloadJson(const std::string& url, json_object** output);
+	virtual bool postJson(const std::string& url, json_object* input, json_object** output);
+	virtual bool putJson(const std::string& url, json_object* input, json_object** output);
+	virtual bool deleteJson(const std::string& url, json_object** output);
+
+	size_t requests() const {
+		return mRequests;
+	}
+
+	size_t writes() const {
+		return mWrites;
+	}
+
+	size_t schedules() const;
+
+private:
+	struct Light {
+		std::string id;
+		bool on;
+		int brightness;
+		std::string alert;
+	};
+
+	struct Hub {
+		std::string id;
+		std::string ip;
+		std::string name;
+		std::vector<Light> lights;
+
+		// By id, as the JSON they were created with.
+		std::map<int, std::string> schedules;
+		int nextSchedule;
+
+		// The indices of the lights in the groups, by id.
+		std::map<int, std::vector<size_t> > groups;
+		int nextGroup;
+	};
+
+	Hub* hub(const std::string& url, std::string& path);
+	json_object* lightToJson(const Light& light) const;
+	static void setState(Light& light, json_object* input);
+	static json_object* success(json_object* value);
+
+	std::vector<Hub> mHubs;
+
+	size_t mRequests;
+	size_t mWrites;
+};
+
+// Runs the tasks against a SimulatedTransport, jumping the clock from one trigger to the next.
+// This simulates when the tasks trigger and what they and their fades write, not the hub workers:
+// every task runs right at its trigger, without the spreading over the budget, retries, warm-ups,
+// reconciling or schedules offloaded to the bridge.
+class HueSimulation {
+public:
+	// The tasks log at taskLevel during the run, the triggers and the summary are reported at info.
+	HueSimulation(HueConfig& config, time_t from, time_t to, LOGGER_LEVEL taskLevel);
+
+	bool run();
+
+private:
+	HueConfig& mConfig;
+
+	time_t mFrom;
+	time_t mTo;
+	LOGGER_LEVEL mTaskLevel;
+};
+
+#endif //INCLUDES_HUE_SIMULATION_H
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include "config.h"
 #include "hub.h"
 #include "light.h"
@@ -13,18 +14,51 @@ class HueLightState;
 
 class HueTask {
 public:
+	typedef HueTask* (*Factory)(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device);
+
 	virtual ~HueTask() {}
 
 	static HueTask* fromConfig(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device);
 
+	// Task types register themselves with REGISTER_TASK_TYPE in their own source file.
+	static bool registerType(const std::string& type, Factory factory);
+
 	virtual bool execute(bool& fatalError) = 0;
 	virtual void updateTrigger(time_t now) = 0;
 
+	// The time of the upcoming trigger, or -1 if there is none.
+	virtual time_t nextTrigger() const = 0;
+
+	// Append up to count trigger times in [from, to) to times, without touching the task state.
+	virtual void project(time_t from, time_t to, size_t count, std::vector<time_t>& times) const = 0;
+
+	// The time of the task as the localtime of a bridge schedule, if the bridge can run the task by itself.
+	virtual bool bridgeTime(time_t now, std::string& localtime) const {
+		return false;
+	}
+
+	// Tasks that trigger in between the minutes, the worker wakes up for their triggers.
+	virtual bool precise() const {
+		return false;
+	}
+
 	bool executeNow();
 
 	bool update(const HueConfig& config, const HueConfigSection& taskConfig);
 	virtual void reset();
 
+	// A hash of the task section and its State and Trigger sections. A task only needs an update
+	// when the fingerprint of its config differs from the one it was last updated with.
+	static uint64_t configFingerprint(const HueConfig& config, const HueConfigSection& taskConfig);
+
+	uint64_t fingerprint() const {
+		return mFingerprint;
+	}
+
+	// The wall clock jumped, reset the task if its upcoming trigger is no longer the projected one.
+	// Returns true if the task was reset.
+	virtual bool clockChanged(time_t now);
+
 	bool valid() const {
 		return mValid;
 	}
@@ -33,6 +67,43 @@ public:
 		return mEnabled;
 	}
 
+	// Critical tasks go first when triggers have to be spread out.
+	bool critical() const {
+		return mCritical;
+	}
+
+	// The configured lights the hub has, sorted by id.
+	const std::vector<HueLight*>& lights() const {
+		return mLights;
+	}
+
+	// All the configured light ids, including the ones the hub doesn't have.
+	const std::vector<std::string>& lightIDs() const {
+		return mLightIDs;
+	}
+
+	// For the hub, when one of the configured lights appears or disappears.
+	void addLight(HueLight* light);
+	void removeLight(HueLight* light);
+
+	const HueLightState& state() const {
+		return mState;
+	}
+
+	// Toggling tasks depend on the state before them, so their triggers can't be skipped.
+	bool toggles() const {
+		return mStateToggle;
+	}
+
+	// The last trigger in [from, to), or -1 if there is none.
+	virtual time_t lastTrigger(time_t from, time_t to) const;
+
+	// Whether the task triggers when executed at now.
+	virtual bool due(time_t now) const {
+		time_t next = nextTrigger();
+		return next >= 0 && next <= now;
+	}
+
 	const std::string& id() const {
 		return mID;
 	}
@@ -40,6 +111,15 @@ public:
 		return mName;
 	}
 
+	const HubDevice& device() const {
+		return mDevice;
+	}
+
+	// How long after a trigger a failed task is still worth retrying, in seconds.
+	int retryWindow() const {
+		return mRetryWindow;
+	}
+
 	void setEnabled(bool enabled) {
 		mEnabled = enabled;
 	}
@@ -63,24 +143,38 @@ protected:
 
 	void generateID();
 
-	bool trigger();
+	virtual bool trigger();
 
 	virtual bool update(const HueConfigSection& triggerConfig) = 0;
 
 	bool mValid;
 
 private:
+	// A function local static, so that it exists before the registrations run.
+	static std::map<std::string, Factory>& types();
+
 	const HubDevice& mDevice;
 
 	bool mEnabled;
+	bool mCritical;
+	int mRetryWindow;
 	std::string mID;
 	std::string mName;
 	std::string mType;
 
 	std::vector<HueLight*> mLights;
+	std::vector<std::string> mLightIDs;
 
 	HueLightState mState;
 	bool mStateToggle;
+
+	uint64_t mFingerprint;
 };
 
+#define REGISTER_TASK_TYPE(t, c) \
+	static HueTask* create##c(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device) {\
+		return new c(config, taskConfig, device);\
+	}\
+	static const bool s##c##Registered __attribute__((unused)) = HueTask::registerType(t, &create##c)
+
 #endif //INCLUDES_HUE_TASK_H
@@ -0,0 +1,32 @@
+#ifndef INCLUDES_HUE_TASKS_TASK_FADE_H
+#define INCLUDES_HUE_TASKS_TASK_FADE_H
+
+#include <string>
+#include <ctime>
+#include "hue/tasks/task_time.h"
+#include "hue/fade.h"
+
+// Triggers like a time task, but fades the lights to the new brightness over duration seconds.
+class HueTaskFade : public HueTaskTime {
+public:
+	HueTaskFade(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device);
+
+	// The bridge can't fade on its own.
+	virtual bool bridgeTime(time_t now, std::string& localtime) const {
+		return false;
+	}
+
+protected:
+	virtual bool trigger();
+	virtual bool update(const HueConfigSection& triggerConfig);
+
+	virtual void toJsonInt(json_object* obj) const;
+	virtual void toStringInt(std::ostringstream& s) const;
+
+private:
+	int mDuration;
+	int mFrom;
+	HueFadeEngine::Curve mCurve;
+};
+
+#endif //INCLUDES_HUE_TASKS_TASK_FADE_H
@@ -0,0 +1,40 @@
+#ifndef INCLUDES_HUE_TASKS_TASK_INTERVAL_H
+#define INCLUDES_HUE_TASKS_TASK_INTERVAL_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include "hue/task.h"
+
+// Triggers every interval seconds, on the times where (time - offset) is a multiple of the interval.
+class HueTaskInterval : public HueTask {
+public:
+	HueTaskInterval(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device);
+
+	virtual bool execute(bool& fatalError);
+	virtual void reset();
+
+	virtual void updateTrigger(time_t now);
+	virtual time_t nextTrigger() const;
+	virtual void project(time_t from, time_t to, size_t count, std::vector<time_t>& times) const;
+
+	virtual bool precise() const {
+		return true;
+	}
+
+protected:
+	virtual bool update(const HueConfigSection& triggerConfig);
+
+	virtual void toJsonInt(json_object* obj) const;
+	virtual void toStringInt(std::ostringstream& s) const;
+
+private:
+	// The first trigger at or after t.
+	time_t alignedAt(time_t t) const;
+
+	int mInterval;
+	int mOffset;
+	time_t mNext;
+};
+
+#endif //INCLUDES_HUE_TASKS_TASK_INTERVAL_H
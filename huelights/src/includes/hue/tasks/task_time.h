@@ -8,6 +8,7 @@
 #include <cstdlib>
 #include <ctime>
 #include "hue/task.h"
+#include "hue/cron.h"
 
 class HueTask;
 
@@ -17,6 +18,7 @@ public:
 		MethodNone = 0,
 		MethodFixed,
 		MethodRecurring,
+		MethodCron,
 	};
 	enum SunCalculation {
 		SunNone = 0,
@@ -24,12 +26,17 @@ public:
 		SunSet = 2,
 	};
 
-	HueTaskTime(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device);
+	// Subclasses pass false for update and run it themselves, so that it reaches their own settings.
+	HueTaskTime(const HueConfig& config, const HueConfigSection &taskConfig, const HubDevice& device, bool update = true);
 
 	virtual bool execute(bool& fatalError);
 	virtual void reset();
 
 	virtual void updateTrigger(time_t now);
+	virtual time_t nextTrigger() const;
+	virtual bool due(time_t now) const;
+	virtual void project(time_t from, time_t to, size_t count, std::vector<time_t>& times) const;
+	virtual bool bridgeTime(time_t now, std::string& localtime) const;
 
 protected:
 	virtual bool update(const HueConfigSection& triggerConfig);
@@ -38,6 +45,9 @@ protected:
 	virtual void toStringInt(std::ostringstream& s) const;
 	
 private:
+	void calculateTrigger(time_t now);
+	void cacheTriggerTime();
+
 	static std::map<std::string, Method> sSupportedMethods;
 
 	Method mTaskMethod;
@@ -45,7 +55,15 @@ private:
 	std::pair<double, double> mPosition;
 	int mTimeSun;
 	struct tm mTime;
-	std::set<uint32_t> mRepeatDays;
+
+	// mTime as a time_t, so that checking for a trigger doesn't need mktime.
+	time_t mTriggerTime;
+
+	// The days (and for triggers without the sun, the time) of recurring triggers.
+	HueCronExpression mCron;
+
+	// The days of recurring triggers, bit 0 is sunday.
+	uint8_t mWeekdays;
 }; 
 
 #endif //INCLUDES_HUE_TASKS_TASK_TIME_H
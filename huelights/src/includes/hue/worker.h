@@ -0,0 +1,96 @@
+#ifndef INCLUDES_HUE_WORKER_H
+#define INCLUDES_HUE_WORKER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <pthread.h>
+#include "hue/retry.h"
+#include "hue/reconciler.h"
+#include "hue/offload.h"
+
+class HubDevice;
+class HueConfig;
+class HueTask;
+
+// Refreshes a hub and executes its tasks on a thread of its own, so that a slow hub doesn't hold up the others.
+class HubWorker {
+public:
+	HubWorker(const std::string& id, HueConfig& config);
+	~HubWorker();
+
+	// Queue a run for the minute starting at start, runs queued while the previous one is busy are merged.
+	// jump is how far the wall clock has moved since the previous run. If missedSince is set, the lights
+	// are first brought to the state the triggers in [missedSince, start) would have left them in.
+	void schedule(const std::string& ip, time_t start, time_t jump, time_t missedSince = -1);
+
+	// Pick up a changed config right away instead of on the next run, without executing any tasks.
+	void reload();
+
+	// Ask the thread to exit once the current run is done.
+	void stop();
+	bool finished() const;
+
+	const std::string& id() const {
+		return mID;
+	}
+
+private:
+	static void* threadMain(void* arg);
+
+	void run();
+	// False when the hub couldn't be reached.
+	bool tick(const std::string& ip, time_t start, time_t jump, time_t missedSince);
+	void reloadConfig();
+	void collectPreciseTasks();
+	void executeTasks();
+	void executePreciseTasks();
+	void executeStaggered();
+	void executeTask(HueTask* task);
+	void scheduleWarmups();
+	void warmUp();
+	void clockChanged(time_t jump);
+	void catchUp(time_t from, time_t to);
+	void retryTasks();
+	void stepFades();
+
+	// When there is work to do in between the scheduled runs, or -1.
+	time_t nextWakeup() const;
+
+	std::string mID;
+	HueConfig& mConfig;
+
+	HubDevice* mDevice;
+
+	pthread_t mThread;
+	mutable pthread_mutex_t mMutex;
+	pthread_cond_t mCond;
+
+	bool mStop;
+	bool mFinished;
+
+	bool mPending;
+	bool mPendingReload;
+	time_t mPendingJump;
+	time_t mPendingMissedSince;
+	time_t mPendingStart;
+	std::string mPendingIp;
+
+	// Only used from the worker thread.
+	HueRetryQueue mRetries;
+	HueReconciler mReconciler;
+	HueScheduleOffload mOffload;
+
+	// Tasks that trigger in between the scheduled runs, collected on every run.
+	std::vector<HueTask*> mPreciseTasks;
+
+	// Tasks whose trigger was spread out, by the time they start.
+	std::multimap<time_t, std::string> mStaggered;
+
+	// Tasks whose lights are refreshed shortly before they trigger, by the time of the refresh.
+	std::multimap<time_t, std::string> mWarmups;
+	time_t mWarmedUntil;
+};
+
+#endif //INCLUDES_HUE_WORKER_H
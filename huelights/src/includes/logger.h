@@ -1,4 +1,9 @@
-#include <fstream>
+#ifndef INCLUDES_LOGGER_H
+#define INCLUDES_LOGGER_H
+
+#include <string>
+#include <sstream>
+#include <pthread.h>
 
 enum LOGGER_LEVEL {
 	LOGGER_LEVEL_DEBUG = 0,
@@ -7,32 +12,116 @@ enum LOGGER_LEVEL {
 	LOGGER_LEVEL_ERROR,
 };
 
+// Lower levels are left out of the build, set with LOGGER_MIN_LEVEL in the Makefile.
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL LOGGER_LEVEL_DEBUG
+#endif
+
+// Use like Logger::debug(), but nothing after the << is evaluated when the level isn't logged.
+#define LOG_AT(level) if(!Logger::enabled(level)) {} else Logger::log(level)
+#define LOG_DEBUG() LOG_AT(LOGGER_LEVEL_DEBUG)
+#define LOG_INFO() LOG_AT(LOGGER_LEVEL_INFO)
+#define LOG_WARNING() LOG_AT(LOGGER_LEVEL_WARNING)
+#define LOG_ERROR() LOG_AT(LOGGER_LEVEL_ERROR)
+
+// Collects one log statement and writes it in one go when it goes out of scope,
+// so that lines from different threads don't get mixed up.
+class LoggerLine {
+public:
+	// Without a stream the line goes to the log file.
+	LoggerLine(bool active, std::ostream* stream);
+	LoggerLine(const LoggerLine& other);
+	~LoggerLine();
+
+	template<typename T>
+	LoggerLine& operator<<(const T& value) {
+		if(mActive) {
+			mBuffer << value;
+		}
+
+		return *this;
+	}
+
+	LoggerLine& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+		if(mActive) {
+			manipulator(mBuffer);
+		}
+
+		return *this;
+	}
+
+private:
+	LoggerLine& operator=(const LoggerLine& other);
+
+	mutable bool mActive;
+	std::ostream* mStream;
+	std::ostringstream mBuffer;
+};
+
 class Logger {
 private:
 	static bool sEnabled;
-	static std::ofstream sStream;
+	static LOGGER_LEVEL sLevel;
+	static pthread_mutex_t sMutex;
+
+	// Lines for the log file go through a ring buffer, which a thread writes out in batches.
+	static int sFd;
+	static bool sDraining;
+	static bool sStopping;
+	static size_t sHead;
+	static size_t sDropped;
+	static pthread_t sThread;
+	static pthread_mutex_t sDrainMutex;
+	static pthread_cond_t sDrainCond;
+
+	static void queue(const std::string& line);
+	static void drain(size_t& tail);
+	static void* drainMain(void* arg);
+
+	friend class LoggerLine;
 
 public:
 	static void init();
-	static void enable() {
-		sEnabled = true;
+
+	// Sends everything to the log file from now on.
+	static void enable();
+
+	// Writes out the lines that are still queued, later lines are written directly.
+	static void shutdown();
+
+	// Messages below this level are discarded.
+	static void setLevel(LOGGER_LEVEL level) {
+		sLevel = level;
+	}
+	static LOGGER_LEVEL level() {
+		return sLevel;
+	}
+
+	// Whether messages of this level are logged, constant for levels below LOGGER_MIN_LEVEL.
+	static bool enabled(LOGGER_LEVEL level) {
+		return level >= LOGGER_MIN_LEVEL && level >= sLevel;
 	}
 
-	static std::ostream& debug() {
+	// Parses debug, info, warning or error.
+	static bool parseLevel(const std::string& name, LOGGER_LEVEL& level);
+
+	static LoggerLine debug() {
 		return log(LOGGER_LEVEL_DEBUG);
 	}
 
-	static std::ostream& info() {
+	static LoggerLine info() {
 		return log(LOGGER_LEVEL_INFO);
 	}
 
-	static std::ostream& warning() {
+	static LoggerLine warning() {
 		return log(LOGGER_LEVEL_WARNING);
 	}
 
-	static std::ostream& error() {
+	static LoggerLine error() {
 		return log(LOGGER_LEVEL_ERROR);
 	}
 
-	static std::ostream& log(LOGGER_LEVEL level);
+	static LoggerLine log(LOGGER_LEVEL level);
 };
+
+#endif //INCLUDES_LOGGER_H
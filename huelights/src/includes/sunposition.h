@@ -6,8 +6,14 @@
 
 class SunPosition {
 public:
+	// False on polar days and nights, when there is no sunrise or sunset and the times are meaningless.
 	static bool getTimes(std::pair<time_t, time_t>& times, time_t date, double lat, double lng);
 
+	// Batched version of getTimes, the inputs and outputs are parallel arrays of count elements.
+	// Uses polynomial trig approximations (within a second of getTimes) so the inner loops vectorize.
+	// Polar day/night is clamped, giving rise and set at solar midnight/noon.
+	static void getTimes(const time_t* dates, const double* lats, const double* lngs, size_t count, time_t* rises, time_t* sets);
+
 private:
 	SunPosition();
 }; 
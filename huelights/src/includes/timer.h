@@ -0,0 +1,40 @@
+#ifndef INCLUDES_TIMER_H
+#define INCLUDES_TIMER_H
+
+#include <ctime>
+
+// Sleeps until wall clock minute boundaries using a CLOCK_MONOTONIC timerfd,
+// and notices when the wall clock is stepped (NTP, suspend, manual changes) through TFD_TIMER_CANCEL_ON_SET.
+class MinuteTimer {
+public:
+	enum Wake {
+		WakeInterrupted = 0,
+		WakeMinute,
+		WakeWatch,
+	};
+
+	MinuteTimer();
+	~MinuteTimer();
+
+	// Also wake up when fd becomes readable, -1 for none.
+	void watch(int fd) {
+		mWatchFd = fd;
+	}
+
+	// Returns WakeInterrupted if interrupted by a signal. jump is how far the wall clock moved
+	// compared to the monotonic clock since the last call, 0 if it didn't.
+	Wake wait(time_t& jump);
+
+private:
+	void armWallTimer();
+	time_t checkJump();
+
+	int mMonoFd;
+	int mWallFd;
+	int mWatchFd;
+
+	struct timespec mLastWall;
+	struct timespec mLastMono;
+};
+
+#endif //INCLUDES_TIMER_H
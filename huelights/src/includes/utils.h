@@ -3,8 +3,15 @@
 
 #include <set>
 #include <vector>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// FNV-1a, continuing from h to hash several pieces as one.
+static const uint64_t sHashBasis = 14695981039346656037ULL;
+uint64_t hashBytes(const char* data, size_t size, uint64_t h = sHashBasis);
 
 void commaListToSet(const std::string& str, std::set<std::string>& v); 
-void commaListToVector(const std::string& str, std::vector<std::string>& v); 
+void commaListToVector(const std::string& str, std::vector<std::string>& v, char separator = ','); 
 
 #endif // INCLUDES_UTILS_H
\ No newline at end of file
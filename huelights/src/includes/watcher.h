@@ -0,0 +1,45 @@
+#ifndef INCLUDES_WATCHER_H
+#define INCLUDES_WATCHER_H
+
+#include <string>
+#include <ctime>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Tells when the contents of a file have changed. The directory is watched with inotify, so that editors
+// that replace the file are noticed too, and mtime and size are compared where inotify isn't available.
+// Only a different hash of the contents counts as a change, touching the file doesn't.
+class FileWatcher {
+public:
+	FileWatcher(const std::string& path);
+	~FileWatcher();
+
+	// Readable when there may be a change, -1 without inotify.
+	int fd() const {
+		return mFd;
+	}
+
+	// Whether the contents differ from the last time this returned true, or from when the watcher was created.
+	bool changed();
+
+private:
+	bool readEvents();
+	bool statChanged();
+	bool hashFile(uint64_t& hash) const;
+
+	std::string mPath;
+	std::string mName;
+
+	int mFd;
+	int mWatch;
+
+	time_t mMtime;
+	long mMtimeNsec;
+	off_t mSize;
+	ino_t mInode;
+
+	uint64_t mHash;
+	bool mHashValid;
+};
+
+#endif //INCLUDES_WATCHER_H
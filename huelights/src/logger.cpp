@@ -1,48 +1,335 @@
 #include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "logger.h"
 
+static const char* sLogPath = "/var/log/huelights";
+
+// A power of two. Lines that don't fit in a slot are allocated separately.
+static const size_t sSlotCount = 512;
+static const size_t sSlotSize = 240;
+
+// How long queued lines wait at most before they are written.
+static const long sDrainIntervalMs = 200;
+
+struct LoggerSlot {
+	// The slot is free for the producer at position sequence, and holds a line for the drain thread
+	// at position sequence - 1.
+	size_t sequence;
+	size_t length;
+	char* overflow;
+	char data[sSlotSize];
+};
+
+static LoggerSlot sSlots[sSlotCount];
+
 bool Logger::sEnabled = false;
-std::ofstream Logger::sStream;
+LOGGER_LEVEL Logger::sLevel = LOGGER_LEVEL_DEBUG;
+pthread_mutex_t Logger::sMutex = PTHREAD_MUTEX_INITIALIZER;
 
-std::ostream &Logger::log(LOGGER_LEVEL level) {
-	if(!sEnabled) {
-		if(level <= LOGGER_LEVEL_INFO) {
-			return std::cout;
+int Logger::sFd = -1;
+bool Logger::sDraining = false;
+bool Logger::sStopping = false;
+size_t Logger::sHead = 0;
+size_t Logger::sDropped = 0;
+pthread_t Logger::sThread;
+pthread_mutex_t Logger::sDrainMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Logger::sDrainCond;
+
+// Every thread formats the time once a second at most.
+static __thread time_t sStampTime = -1;
+static __thread char sStamp[32];
+
+static const char* timestamp() {
+	time_t now = time(NULL);
+	if(now != sStampTime) {
+		struct tm timeinfo;
+		localtime_r(&now, &timeinfo);
+		strftime(sStamp, sizeof(sStamp), "%Y-%m-%d %H:%M:%S", &timeinfo);
+		sStampTime = now;
+	}
+
+	return sStamp;
+}
+
+static void writeAll(int fd, const char* data, size_t size) {
+	while(fd >= 0 && size > 0) {
+		ssize_t written = write(fd, data, size);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return;
+		}
+
+		data += written;
+		size -= written;
+	}
+}
+
+LoggerLine::LoggerLine(bool active, std::ostream* stream)
+	: mActive(active),
+	mStream(stream)
+{
+
+}
+
+LoggerLine::LoggerLine(const LoggerLine& other)
+	: mActive(other.mActive),
+	mStream(other.mStream)
+{
+	// Only the last copy writes the line.
+	mBuffer << other.mBuffer.str();
+	other.mActive = false;
+}
+
+LoggerLine::~LoggerLine() {
+	if(!mActive) {
+		return;
+	}
+
+	if(mStream == NULL) {
+		Logger::queue(mBuffer.str());
+		return;
+	}
+
+	pthread_mutex_lock(&Logger::sMutex);
+	*mStream << mBuffer.str() << std::flush;
+	pthread_mutex_unlock(&Logger::sMutex);
+}
+
+void Logger::enable() {
+	pthread_mutex_lock(&sMutex);
+	if(sEnabled) {
+		pthread_mutex_unlock(&sMutex);
+		return;
+	}
+
+	sFd = open(sLogPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	for(size_t i = 0; i < sSlotCount; i++) {
+		sSlots[i].sequence = i;
+		sSlots[i].length = 0;
+		sSlots[i].overflow = NULL;
+	}
+	sHead = 0;
+	sDropped = 0;
+	sStopping = false;
+
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sDrainCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+
+	// Without the thread lines are written directly, like after shutdown().
+	if(pthread_create(&sThread, NULL, &Logger::drainMain, NULL) == 0) {
+		__atomic_store_n(&sDraining, true, __ATOMIC_RELEASE);
+	} else {
+		pthread_cond_destroy(&sDrainCond);
+	}
+
+	sEnabled = true;
+	pthread_mutex_unlock(&sMutex);
+}
+
+void Logger::shutdown() {
+	if(!__atomic_load_n(&sDraining, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	// The other threads have stopped logging by now, a line that still comes in is written directly.
+	__atomic_store_n(&sDraining, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&sDrainMutex);
+	sStopping = true;
+	pthread_cond_signal(&sDrainCond);
+	pthread_mutex_unlock(&sDrainMutex);
+
+	pthread_join(sThread, NULL);
+	pthread_cond_destroy(&sDrainCond);
+}
+
+void Logger::queue(const std::string& line) {
+	if(!__atomic_load_n(&sDraining, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&sMutex);
+		writeAll(sFd, line.data(), line.size());
+		pthread_mutex_unlock(&sMutex);
+		return;
+	}
+
+	// Claim the slot at the head, unless the drain thread hasn't freed it yet.
+	LoggerSlot* slot;
+	size_t position = __atomic_load_n(&sHead, __ATOMIC_RELAXED);
+	while(true) {
+		slot = &sSlots[position & (sSlotCount - 1)];
+		intptr_t diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)position;
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&sHead, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if(diff < 0) {
+			// Full, rather than holding up the caller the line is dropped and counted.
+			__atomic_fetch_add(&sDropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			position = __atomic_load_n(&sHead, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->length = line.size();
+	if(line.size() <= sSlotSize) {
+		memcpy(slot->data, line.data(), line.size());
+	} else {
+		slot->overflow = static_cast<char*>(malloc(line.size()));
+		if(slot->overflow != NULL) {
+			memcpy(slot->overflow, line.data(), line.size());
+		} else {
+			slot->length = 0;
+			__atomic_fetch_add(&sDropped, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+	// Otherwise the drain thread gets to it on its next round.
+	if(((position + 1) & (sSlotCount / 2 - 1)) == 0) {
+		pthread_cond_signal(&sDrainCond);
+	}
+}
+
+void Logger::drain(size_t& tail) {
+	char batch[16384];
+	size_t used = 0;
+
+	while(true) {
+		LoggerSlot& slot = sSlots[tail & (sSlotCount - 1)];
+		if(__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != tail + 1) {
+			break;
+		}
+
+		const char* data = (slot.overflow != NULL) ? slot.overflow : slot.data;
+		if(used + slot.length > sizeof(batch)) {
+			writeAll(sFd, batch, used);
+			used = 0;
+		}
+
+		if(slot.length > sizeof(batch)) {
+			writeAll(sFd, data, slot.length);
+		} else {
+			memcpy(batch + used, data, slot.length);
+			used += slot.length;
+		}
+
+		free(slot.overflow);
+		slot.overflow = NULL;
+
+		__atomic_store_n(&slot.sequence, tail + sSlotCount, __ATOMIC_RELEASE);
+		tail++;
+	}
+
+	size_t dropped = __atomic_exchange_n(&sDropped, 0, __ATOMIC_RELAXED);
+	if(dropped > 0) {
+		std::ostringstream s;
+		s << "[Warning] " << timestamp() << ": Dropped " << dropped << " log lines, the log couldn't keep up\n";
+
+		std::string line = s.str();
+		if(used + line.size() > sizeof(batch)) {
+			writeAll(sFd, batch, used);
+			used = 0;
+		}
+
+		memcpy(batch + used, line.data(), line.size());
+		used += line.size();
+	}
+
+	writeAll(sFd, batch, used);
+}
+
+void* Logger::drainMain(void* arg) {
+	size_t tail = 0;
+
+	pthread_mutex_lock(&sDrainMutex);
+	while(true) {
+		// Everything queued before shutdown() is written in the last round.
+		bool stopping = sStopping;
+		pthread_mutex_unlock(&sDrainMutex);
+
+		drain(tail);
+
+		pthread_mutex_lock(&sDrainMutex);
+		if(stopping) {
+			break;
 		}
 
-		return std::cerr;
+		if(!sStopping) {
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_nsec += sDrainIntervalMs * 1000000;
+			if(until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait(&sDrainCond, &sDrainMutex, &until);
+		}
 	}
+	pthread_mutex_unlock(&sDrainMutex);
 
-	if(!sStream.is_open()) {
-		sStream.open("/var/log/huelights", std::ofstream::out | std::ofstream::app);
-		sStream << std::unitbuf;
+	return NULL;
+}
+
+bool Logger::parseLevel(const std::string& name, LOGGER_LEVEL& level) {
+	if(name == "debug") {
+		level = LOGGER_LEVEL_DEBUG;
+	} else if(name == "info") {
+		level = LOGGER_LEVEL_INFO;
+	} else if(name == "warning") {
+		level = LOGGER_LEVEL_WARNING;
+	} else if(name == "error") {
+		level = LOGGER_LEVEL_ERROR;
+	} else {
+		return false;
 	}
 
-	time_t rawtime;
-	struct tm * timeinfo;
-	char buffer[128];
+	return true;
+}
+
+LoggerLine Logger::log(LOGGER_LEVEL level) {
+	if(!enabled(level)) {
+		return LoggerLine(false, NULL);
+	}
 
-	time (&rawtime);
-	timeinfo = localtime(&rawtime);
+	if(!sEnabled) {
+		if(level <= LOGGER_LEVEL_INFO) {
+			return LoggerLine(true, &std::cout);
+		}
 
-	strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", timeinfo);
+		return LoggerLine(true, &std::cerr);
+	}
 
+	LoggerLine line(true, NULL);
 	switch(level) {
 		case LOGGER_LEVEL_DEBUG:
-			sStream << "[Debug]";
+			line << "[Debug]";
 			break;
 		case LOGGER_LEVEL_WARNING:
-			sStream << "[Warning]";
+			line << "[Warning]";
 			break;
 		case LOGGER_LEVEL_ERROR:
-			sStream << "[Error]";
+			line << "[Error]";
 			break;
 		default:
-			sStream << "[Info]";
+			line << "[Info]";
 	}
 
-	sStream << " " << std::string(buffer) << ": ";
-	return sStream;
-}
\ No newline at end of file
+	line << " " << timestamp() << ": ";
+	return line;
+}
@@ -1,11 +1,19 @@
 #include <iostream>
 #include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstdio>
 #include <ctime>
+#include <cstring>
+#include <csignal>
 #include <unistd.h>
 
 #include "logger.h"
+#include "clock.h"
+#include "timer.h"
+#include "watcher.h"
+#include "benchmark.h"
 #include "hue/hue.h"
 
 enum ArgCommand {
@@ -14,6 +22,8 @@ enum ArgCommand {
 	ArgCommandAuthorize,
 	ArgCommandLight,
 	ArgCommandList,
+	ArgCommandBenchmark,
+	ArgCommandSimulate,
 };
 
 enum ArgListType {
@@ -29,6 +39,11 @@ enum ArgTypes {
 	ArgTypeLightBrightness,
 	ArgTypeListDisplay,
 	ArgTypeListType,
+	ArgTypeScheduleDays,
+	ArgTypeScheduleCount,
+	ArgTypeBenchmark,
+	ArgTypeSimulateRange,
+	ArgTypeLogLevel,
 };
 
 static void printHelp() {
@@ -67,100 +82,223 @@ static void printHelp() {
 	<< "\t\t\t" << "or list all lights on all found hubs" << "\n"
 	<< "\t\t" << "tasks" << "\n"
 	<< "\t\t\t" << "List all configured tasks" << "\n"
-	<< "\t\t\t" << "You can use --hub to specify the device, and/or --light for the light" << "\n"
+	<< "\t\t\t" << "You can use --hub to specify the device, and/or --light for the tasks of a light" << "\n"
+	<< "\t\t" << "schedule" << "\n"
+	<< "\t\t\t" << "List the upcoming triggers of all configured tasks" << "\n"
+	<< "\t\t\t" << "You can use --hub to specify the device" << "\n"
+	<< "\t" << "--days <days>" << "\n"
+	<< "\t\t" << "How many days ahead to list the schedule for (defaults to 30)" << "\n"
+	<< "\t" << "--count <count>" << "\n"
+	<< "\t\t" << "The maximum number of triggers to list per task (defaults to 10)" << "\n"
 	<< "\t" << "--json" << "\n"
 	<< "\t\t" << "Output the list commands in json format" << "\n"
+
+	<< "\t" << "--simulate <from>..<to>" << "\n"
+	<< "\t\t" << "Run all tasks in the config file against simulated hubs" << "\n"
+	<< "\t\t" << "from <from> to <to> (YYYY-MM-DD[ HH:MM]), printing every trigger" << "\n"
+	<< "\t\t" << "Only the triggers and fades are simulated, not the spreading, retries or reconciling" << "\n"
+
+	<< "\t" << "--benchmark <type>" << "\n"
+	<< "\t\t" << "Run a benchmark, <type> can be one of" << "\n"
+	<< "\t\t" << "sun" << "\n"
+	<< "\t\t\t" << "Compare the scalar and batched sunrise/sunset calculations" << "\n"
+	<< "\t\t" << "dispatch" << "\n"
+	<< "\t\t\t" << "Time the task dispatch of a day of ticks with thousands of tasks" << "\n"
+	<< "\t\t" << "config" << "\n"
+	<< "\t\t\t" << "Compare the config parser with line by line parsing on 10000 sections" << "\n"
+	<< "\t\t" << "startup" << "\n"
+	<< "\t\t\t" << "Compare loading the config from text and from its snapshot" << "\n"
+	<< "\t\t" << "logging" << "\n"
+	<< "\t\t\t" << "Time disabled and enabled debug logging on the light write path" << "\n"
+
+	<< "\t" << "--log-level <level>" << "\n"
+	<< "\t\t" << "Only log messages of <level> and up, one of debug, info, warning or error" << "\n"
+	<< "\t\t" << "Levels below the one the program was built with are never logged" << "\n"
 	<< "\n";
 }
 
+static volatile sig_atomic_t sRunning = 1;
+
+static void stopDaemon(int signal) {
+	sRunning = 0;
+}
+
+// Where the start of the last handled minute is kept, on tmpfs so it only outlives the daemon and not a reboot.
+static const char* sLastRunPath = "/var/run/huelights.lastrun";
+
+// Smaller forward jumps are ordinary scheduling jitter, the triggers in them are run as usual.
+static const time_t sCatchUpThreshold = 120;
+
+// Sun triggers are worked out for every day up to the end of a schedule, so it can't be longer than this.
+static const long sMaxScheduleDays = 36500;
+
+static time_t readLastRun() {
+	FILE* file = fopen(sLastRunPath, "r");
+	if(file == NULL) {
+		return -1;
+	}
+
+	long lastRun = -1;
+	if(fscanf(file, "%ld", &lastRun) != 1) {
+		lastRun = -1;
+	}
+
+	fclose(file);
+	return lastRun;
+}
+
+static void writeLastRun(time_t lastRun) {
+	FILE* file = fopen(sLastRunPath, "w");
+	if(file == NULL) {
+		return;
+	}
+
+	fprintf(file, "%ld\n", (long)lastRun);
+	fclose(file);
+}
+
 static bool runDaemon(HueConfig& config, const std::map<ArgTypes, std::string> &params, bool& showHelp) {
-	std::vector<HubDevice* > devices;
+	// One worker per hub, the workers do all the communication with their hub.
+	std::map<std::string, HubWorker*> workers;
+	std::vector<HubWorker*> stoppedWorkers;
 
 	Logger::enable();
 	Logger::info() << "\n";
 	Logger::info() << "Starting daemon\n";
 
-	std::map<std::string, int> failedTasks;
-	std::vector<std::string> permanentFailedTasks;
-	time_t lastTime = time(NULL);
-	bool running = true;
-	while(running) {
-		// Calculate when the next minute starts
-		time_t start = time(NULL);
-
-		time_t end = start;
-		struct tm* endTime = std::localtime(&end);
-		++endTime->tm_min;
-		endTime->tm_sec = 0;
-		end = mktime(endTime);
-
-		// Sleep until that time
-		uint64_t diff = difftime(end, start);
-		sleep(diff);
-
-		bool parseFailure = false;
-		if(!config.parse(parseFailure)) {
-			if(parseFailure) {
-				Logger::error() << "Failed to parse config file!\n";
-			} else {
-				Logger::error() << "Failed to read config file!\n";
-			}
+	signal(SIGTERM, stopDaemon);
+	signal(SIGINT, stopDaemon);
+
+	// How far the wall clock has moved since the workers were last told.
+	time_t jump = 0;
+
+	// The start of a gap in which triggers were missed, or -1. Either the daemon wasn't running
+	// or the clock jumped forward (which includes a suspend).
+	time_t missedSince = -1;
+	time_t lastRun = readLastRun();
+	if(lastRun >= 0) {
+		missedSince = lastRun + 60;
+	}
 
-			lastTime = time(NULL);
+	// The config was parsed on startup, after that only when the file changes.
+	FileWatcher watcher(config.path());
+	bool reparse = false;
+
+	MinuteTimer timer;
+	timer.watch(watcher.fd());
+	while(sRunning) {
+		// Sleep until the next minute starts, or until the config file is written.
+		time_t change = 0;
+		MinuteTimer::Wake wake = timer.wait(change);
+		jump += change;
+
+		if(wake == MinuteTimer::WakeInterrupted || !sRunning) {
 			continue;
 		}
 
-		if(!Hue::getHubDevices(devices, config)) {
-			lastTime = time(NULL);
-			continue;
+		if(watcher.changed()) {
+			reparse = true;
 		}
 
-		for(std::vector<HubDevice*>::const_iterator deviceIt = devices.begin(); deviceIt != devices.end(); ++deviceIt) {
-			for(std::vector<HueTask*>::const_iterator it = (*deviceIt)->tasks().begin(); it != (*deviceIt)->tasks().end(); ++it) {
-				// We're going back in time, call the troops (reset the task)!
-				if(start < lastTime || start - lastTime > 60*2) {
-					(*it)->reset();
-				}
+		if(reparse) {
+			bool parseFailure = false;
+			bool parsed = false;
+			{
+				HueConfigLock lock(config, true);
+				parsed = config.parse(parseFailure);
+			}
 
-				std::string id = (*it)->id();
-				bool result = true;
-				if(std::find(permanentFailedTasks.begin(), permanentFailedTasks.end(), id) == permanentFailedTasks.end() && failedTasks.find(id) != failedTasks.end()) {
-					result = (*it)->executeNow();
-					if(result) {
-						failedTasks.erase(id);
-					} else if(failedTasks.find(id)->second >= 4) {
-						permanentFailedTasks.push_back(id);
-					}
+			if(!parsed) {
+				if(parseFailure) {
+					Logger::error() << "Failed to parse config file!\n";
+				} else {
+					Logger::error() << "Failed to read config file!\n";
 				}
 
-				bool done = true;
-				bool error = false;
-				if(result) {
-					done = (*it)->execute(error);
-					if(done && !error) {
-						permanentFailedTasks.erase(std::find(permanentFailedTasks.begin(), permanentFailedTasks.end(), id));
-						failedTasks.erase(id);
-					}
+				// Tried again every minute, nothing runs until it succeeds.
+				continue;
+			}
+
+			reparse = false;
+			Logger::info() << "Reloaded config " << config.path() << "\n";
+
+			// The workers rebuild their tasks now, the tasks themselves still only run on the minute.
+			if(wake == MinuteTimer::WakeWatch) {
+				for(std::map<std::string, HubWorker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+					it->second->reload();
 				}
+			}
+		}
 
-				if(!result || (done && error)) {
-					int retryCount = 1;
-					if(failedTasks.find((*it)->id()) != failedTasks.end()) {
-						retryCount += failedTasks.find((*it)->id())->second;
-					}
+		if(wake == MinuteTimer::WakeWatch) {
+			continue;
+		}
+
+		time_t start = Clock::now();
+
+		// Also counts jumps from wakes that didn't get this far, like those of the watcher or a failed parse.
+		if(jump > sCatchUpThreshold && (missedSince < 0 || start - jump < missedSince)) {
+			missedSince = start - jump;
+		}
+
+		std::vector<std::pair<std::string, std::string> > hubs;
+		if(!Hue::discoverHubs(hubs)) {
+			continue;
+		}
 
-					failedTasks[(*it)->id()] = retryCount;
+		// Stop the workers of hubs that have disappeared, they are deleted once they have finished.
+		for(std::map<std::string, HubWorker*>::iterator it = workers.begin(); it != workers.end();) {
+			bool found = false;
+			for(std::vector<std::pair<std::string, std::string> >::const_iterator hubIt = hubs.begin(); hubIt != hubs.end(); ++hubIt) {
+				if(hubIt->first == it->first) {
+					found = true;
+					break;
 				}
 			}
+
+			if(found) {
+				++it;
+				continue;
+			}
+
+			it->second->stop();
+			stoppedWorkers.push_back(it->second);
+			workers.erase(it++);
+		}
+
+		for(std::vector<std::pair<std::string, std::string> >::const_iterator it = hubs.begin(); it != hubs.end(); ++it) {
+			std::map<std::string, HubWorker*>::iterator workerIt = workers.find(it->first);
+			if(workerIt == workers.end()) {
+				workerIt = workers.insert(std::make_pair(it->first, new HubWorker(it->first, config))).first;
+			}
+
+			workerIt->second->schedule(it->second, start, jump, missedSince);
 		}
 
-		lastTime = time(NULL);
+		jump = 0;
+		missedSince = -1;
+		writeLastRun(start);
+
+		for(size_t i = 0; i < stoppedWorkers.size(); i++) {
+			if(stoppedWorkers[i]->finished()) {
+				delete stoppedWorkers[i];
+				stoppedWorkers.erase(stoppedWorkers.begin() + i);
+				i--;
+			}
+		}
+	}
+
+	Logger::info() << "Stopping daemon\n";
+
+	for(std::map<std::string, HubWorker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+		delete it->second;
 	}
 
-	for(std::vector<HubDevice*>::iterator it = devices.begin(); it != devices.end(); ++it) {
+	for(std::vector<HubWorker*>::iterator it = stoppedWorkers.begin(); it != stoppedWorkers.end(); ++it) {
 		delete *it;
 	}
 
+	Logger::shutdown();
 	return true;
 }
 
@@ -442,12 +580,19 @@ static bool runList(HueConfig& config, const std::map<ArgTypes, std::string> &pa
 			}
 		}
 
-		time_t now = time(NULL);
+		time_t now = Clock::now();
+
+		// Only the tasks of a light with --light, looked up by its uniqueid.
+		std::string light;
+		if(params.count(ArgTypeLight) != 0) {
+			light = params.at(ArgTypeLight);
+		}
 
 		switch(listType) {
 			case ArgListTypeNormal: {
 				for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
-					for(std::vector<HueTask*>::const_iterator taskIt = (*it)->tasks().begin(); taskIt != (*it)->tasks().end(); ++taskIt) {
+					const std::vector<HueTask*>& tasks = light.empty() ? (*it)->tasks() : (*it)->lightTasks(light);
+					for(std::vector<HueTask*>::const_iterator taskIt = tasks.begin(); taskIt != tasks.end(); ++taskIt) {
 						(*taskIt)->updateTrigger(now);
 						Logger::info() << (*taskIt)->toString() << "\n\n";
 					}
@@ -458,7 +603,8 @@ static bool runList(HueConfig& config, const std::map<ArgTypes, std::string> &pa
 			case ArgListTypeJson: {
 				json_object* arrObj = json_object_new_array();
 				for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
-					for(std::vector<HueTask*>::const_iterator taskIt = (*it)->tasks().begin(); taskIt != (*it)->tasks().end(); ++taskIt) {
+					const std::vector<HueTask*>& tasks = light.empty() ? (*it)->tasks() : (*it)->lightTasks(light);
+					for(std::vector<HueTask*>::const_iterator taskIt = tasks.begin(); taskIt != tasks.end(); ++taskIt) {
 						(*taskIt)->updateTrigger(now);
 						json_object_array_add(arrObj, (*taskIt)->toJson());
 					}
@@ -471,6 +617,57 @@ static bool runList(HueConfig& config, const std::map<ArgTypes, std::string> &pa
 			}
 		}
 
+		for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
+			delete *it;
+		}
+	} else if(type == "schedule") {
+		std::vector<HubDevice* > devices;
+		if(params.count(ArgTypeHub) != 0) {
+			HubDevice* device = Hue::getHubDevice(params.at(ArgTypeHub), config);
+			if(device == NULL) {
+				Logger::error() << "Error: Failed to get device " << params.at(ArgTypeHub) << "\n";
+				return false;
+			}
+
+			devices.push_back(device);
+		} else {
+			if(!Hue::getHubDevices(devices, config)) {
+				Logger::error() << "Error: Failed to get devices\n";
+				return false;
+			}
+		}
+
+		// Both were checked to be positive when the arguments were parsed.
+		long days = 30;
+		if(params.count(ArgTypeScheduleDays) != 0) {
+			days = strtol(params.at(ArgTypeScheduleDays).c_str(), NULL, 10);
+		}
+
+		size_t count = 10;
+		if(params.count(ArgTypeScheduleCount) != 0) {
+			count = strtol(params.at(ArgTypeScheduleCount).c_str(), NULL, 10);
+		}
+
+		time_t now = Clock::now();
+
+		HueSchedule schedule(now, now + (time_t)days * 24 * 60 * 60, count);
+		schedule.project(devices);
+
+		switch(listType) {
+			case ArgListTypeNormal: {
+				Logger::info() << schedule.toString() << "\n\n";
+				break;
+			}
+			case ArgListTypeJson: {
+				json_object* arrObj = schedule.toJson();
+
+				Logger::info() << json_object_to_json_string_ext(arrObj, JSON_C_TO_STRING_PLAIN);
+				json_object_put(arrObj);
+
+				break;
+			}
+		}
+
 		for(std::vector<HubDevice*>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
 			delete *it;
 		}
@@ -482,6 +679,57 @@ static bool runList(HueConfig& config, const std::map<ArgTypes, std::string> &pa
 	return true;
 }
 
+static bool parseSimulateTime(const std::string& str, time_t& t) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(struct tm));
+
+	const char* end = strptime(str.c_str(), "%Y-%m-%d %H:%M", &tm);
+	if(end == NULL || *end != 0) {
+		memset(&tm, 0, sizeof(struct tm));
+
+		end = strptime(str.c_str(), "%Y-%m-%d", &tm);
+		if(end == NULL || *end != 0) {
+			return false;
+		}
+	}
+
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	return true;
+}
+
+static bool runSimulate(HueConfig& config, const std::map<ArgTypes, std::string> &params, bool& showHelp) {
+	if(params.count(ArgTypeSimulateRange) == 0) {
+		showHelp = true;
+		return false;
+	}
+
+	std::string range = params.at(ArgTypeSimulateRange);
+	size_t pos = range.find("..");
+
+	time_t from, to;
+	if(pos == std::string::npos || !parseSimulateTime(range.substr(0, pos), from) || !parseSimulateTime(range.substr(pos + 2), to) || to <= from) {
+		Logger::error() << "Error: Invalid simulation range " << range << "\n";
+		showHelp = true;
+		return false;
+	}
+
+	// Keep the output to the triggers, unless something goes wrong or more was asked for.
+	LOGGER_LEVEL taskLevel = (params.count(ArgTypeLogLevel) == 0) ? LOGGER_LEVEL_WARNING : Logger::level();
+
+	HueSimulation simulation(config, from, to, taskLevel);
+	return simulation.run();
+}
+
+static bool runBenchmark(HueConfig& config, const std::map<ArgTypes, std::string> &params, bool& showHelp) {
+	if(params.count(ArgTypeBenchmark) == 0) {
+		showHelp = true;
+		return false;
+	}
+
+	return Benchmark::run(params.at(ArgTypeBenchmark));
+}
+
 int main(int argc, char** argv) {
 	ArgCommand argCommand = ArgCommandNone;
 	std::map<ArgTypes, std::string> argParams;
@@ -520,7 +768,10 @@ int main(int argc, char** argv) {
 				return -1;
 			}
 
-			argCommand = ArgCommandLight;
+			// Also a filter for --list, which it mustn't override.
+			if(argCommand == ArgCommandNone) {
+				argCommand = ArgCommandLight;
+			}
 			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeLight, std::string(argv[i + 1])));
 			i++;
 		} else if(arg == "--brightness") {
@@ -547,6 +798,28 @@ int main(int argc, char** argv) {
 
 			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeLightState, std::string(argv[i + 1])));
 			i++;
+		} else if(arg == "--days" || arg == "--count") {
+			if(i + 1 >= argc) {
+				printHelp();
+				return -1;
+			}
+
+			char* p = NULL;
+			errno = 0;
+			long val = strtol(argv[i + 1], &p, 10);
+			if(*p != 0 || errno == ERANGE || val <= 0 || val > INT_MAX) {
+				Logger::error() << "Error: " << argv[i + 1] << " is not a valid number (must be from 1 to " << INT_MAX << ")\n";
+				printHelp();
+				return -1;
+			}
+			if(arg == "--days" && val > sMaxScheduleDays) {
+				Logger::error() << "Error: " << argv[i + 1] << " days is too far ahead (at most " << sMaxScheduleDays << ")\n";
+				printHelp();
+				return -1;
+			}
+
+			argParams.insert(std::make_pair<ArgTypes, std::string>((arg == "--days") ? ArgTypeScheduleDays : ArgTypeScheduleCount, std::string(argv[i + 1])));
+			i++;
 		} else if(arg == "--json") {
 			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeListDisplay, "json"));
 		} else if(arg == "-d" || arg == "--daemon") {
@@ -562,6 +835,34 @@ int main(int argc, char** argv) {
 			argCommand = ArgCommandList;
 			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeListType, std::string(argv[i + 1])));
 			i++;
+		} else if(arg == "--simulate") {
+			if(i + 1 >= argc) {
+				printHelp();
+				return -1;
+			}
+
+			argCommand = ArgCommandSimulate;
+			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeSimulateRange, std::string(argv[i + 1])));
+			i++;
+		} else if(arg == "--log-level") {
+			LOGGER_LEVEL level;
+			if(i + 1 >= argc || !Logger::parseLevel(argv[i + 1], level)) {
+				printHelp();
+				return -1;
+			}
+
+			Logger::setLevel(level);
+			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeLogLevel, std::string(argv[i + 1])));
+			i++;
+		} else if(arg == "--benchmark") {
+			if(i + 1 >= argc) {
+				printHelp();
+				return -1;
+			}
+
+			argCommand = ArgCommandBenchmark;
+			argParams.insert(std::make_pair<ArgTypes, std::string>(ArgTypeBenchmark, std::string(argv[i + 1])));
+			i++;
 		} else {
 			Logger::error() << "Error: Unknown option " << argv[i] << "\n";
 			printHelp();
@@ -634,6 +935,30 @@ int main(int argc, char** argv) {
 
 			break;
 		}
+		case ArgCommandSimulate: {
+			if(!runSimulate(hueConfig, argParams, showHelp)) {
+				if(showHelp) {
+					printHelp();
+					return -1;
+				}
+
+				Logger::error() << "Error: Simulate command failed\n";
+			}
+
+			break;
+		}
+		case ArgCommandBenchmark: {
+			if(!runBenchmark(hueConfig, argParams, showHelp)) {
+				if(showHelp) {
+					printHelp();
+					return -1;
+				}
+
+				Logger::error() << "Error: Benchmark command failed\n";
+			}
+
+			break;
+		}
 		default:
 			break;
 	}
@@ -0,0 +1,152 @@
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "logger.h"
+#include "timer.h"
+
+// Smaller differences between the two clocks are just drift (or NTP slewing).
+static const time_t sJumpThreshold = 5;
+
+MinuteTimer::MinuteTimer()
+	: mMonoFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)),
+	mWallFd(timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC)),
+	mWatchFd(-1)
+{
+	if(mMonoFd < 0 || mWallFd < 0) {
+		Logger::error() << "Failed to create timers: " << strerror(errno) << "\n";
+	}
+
+	armWallTimer();
+
+	clock_gettime(CLOCK_REALTIME, &mLastWall);
+	clock_gettime(CLOCK_MONOTONIC, &mLastMono);
+}
+
+MinuteTimer::~MinuteTimer() {
+	if(mMonoFd >= 0) {
+		close(mMonoFd);
+	}
+	if(mWallFd >= 0) {
+		close(mWallFd);
+	}
+}
+
+void MinuteTimer::armWallTimer() {
+	if(mWallFd < 0) {
+		return;
+	}
+
+	// This timer never expires, it only exists to be cancelled when the wall clock is set.
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	clock_gettime(CLOCK_REALTIME, &spec.it_value);
+	spec.it_value.tv_sec += 60 * 60 * 24 * 365;
+
+	timerfd_settime(mWallFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+}
+
+time_t MinuteTimer::checkJump() {
+	struct timespec wall, mono;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+
+	int64_t wallElapsed = (int64_t)(wall.tv_sec - mLastWall.tv_sec) * 1000 + (wall.tv_nsec - mLastWall.tv_nsec) / 1000000;
+	int64_t monoElapsed = (int64_t)(mono.tv_sec - mLastMono.tv_sec) * 1000 + (mono.tv_nsec - mLastMono.tv_nsec) / 1000000;
+
+	mLastWall = wall;
+	mLastMono = mono;
+
+	time_t jump = (wallElapsed - monoElapsed) / 1000;
+	if(jump > -sJumpThreshold && jump < sJumpThreshold) {
+		return 0;
+	}
+
+	return jump;
+}
+
+MinuteTimer::Wake MinuteTimer::wait(time_t& jump) {
+	jump = 0;
+
+	while(true) {
+		struct timespec wall;
+		clock_gettime(CLOCK_REALTIME, &wall);
+
+		// Sleep until the next minute starts on the monotonic clock, with a little margin
+		// so that the wall clock is sure to be past the boundary when we wake up.
+		struct itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_sec = 59 - (wall.tv_sec % 60);
+		spec.it_value.tv_nsec = 1000000000 - wall.tv_nsec + 100000000;
+		while(spec.it_value.tv_nsec >= 1000000000) {
+			spec.it_value.tv_sec++;
+			spec.it_value.tv_nsec -= 1000000000;
+		}
+
+		if(mMonoFd < 0) {
+			// No timerfd support, fall back to plain sleeps.
+			if(sleep(spec.it_value.tv_sec + 1) != 0) {
+				return WakeInterrupted;
+			}
+
+			jump = checkJump();
+			return WakeMinute;
+		}
+
+		timerfd_settime(mMonoFd, 0, &spec, NULL);
+
+		// A missing wall timer stays in the list with a negative fd, which poll ignores.
+		struct pollfd fds[3];
+		fds[0].fd = mMonoFd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = mWallFd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		fds[2].fd = mWatchFd;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
+
+		if(poll(fds, (mWatchFd >= 0) ? 3 : 2, -1) < 0) {
+			if(errno == EINTR) {
+				return WakeInterrupted;
+			}
+
+			continue;
+		}
+
+		uint64_t expirations;
+		if((fds[1].revents & POLLIN) != 0) {
+			// The read fails with ECANCELED when the clock has been set.
+			if(read(mWallFd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED) {
+				time_t change = checkJump();
+				if(change != 0) {
+					Logger::info() << "Wall clock changed by " << change << "s\n";
+					jump += change;
+				}
+			}
+
+			armWallTimer();
+
+			// The minute boundary has moved with the clock.
+			continue;
+		}
+
+		if((fds[0].revents & POLLIN) != 0) {
+			if(read(mMonoFd, &expirations, sizeof(expirations)) < 0) {
+				continue;
+			}
+
+			// Catches changes that don't cancel the timer, like suspend on some systems.
+			jump += checkJump();
+			return WakeMinute;
+		}
+
+		// The watched fd is left for the caller to read.
+		if((fds[2].revents & POLLIN) != 0) {
+			return WakeWatch;
+		}
+	}
+}
@@ -19,10 +19,10 @@ void commaListToSet(const std::string& str, std::set<std::string>& v) {
 	} while(epos != std::string::npos && bpos < str.length());
 }
 
-void commaListToVector(const std::string& str, std::vector<std::string>& v) {
+void commaListToVector(const std::string& str, std::vector<std::string>& v, char separator) {
 	size_t bpos = 0, epos = 0;
 	do {
-		epos = str.find(',', bpos);
+		epos = str.find(separator, bpos);
 		if(epos == std::string::npos && bpos < str.length()) {
 			epos = str.length();
 		}
@@ -35,3 +35,12 @@ void commaListToVector(const std::string& str, std::vector<std::string>& v) {
 		bpos = epos + 1;
 	} while(epos != std::string::npos && bpos < str.length());
 }
+
+uint64_t hashBytes(const char* data, size_t size, uint64_t h) {
+	for(size_t i = 0; i < size; i++) {
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
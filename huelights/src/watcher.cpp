@@ -0,0 +1,148 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "logger.h"
+#include "utils.h"
+#include "watcher.h"
+
+FileWatcher::FileWatcher(const std::string& path)
+	: mPath(path),
+	mName(path),
+	mFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+	mWatch(-1),
+	mMtime(0),
+	mMtimeNsec(0),
+	mSize(0),
+	mInode(0),
+	mHash(0),
+	mHashValid(false)
+{
+	std::string dir = ".";
+	size_t slash = path.rfind('/');
+	if(slash != std::string::npos) {
+		dir = (slash == 0) ? "/" : path.substr(0, slash);
+		mName = path.substr(slash + 1);
+	}
+
+	if(mFd >= 0) {
+		// Editors and package managers often write a new file and rename it over the old one.
+		mWatch = inotify_add_watch(mFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	}
+
+	if(mWatch < 0) {
+		Logger::warning() << "Can't watch " << path << " (" << strerror(errno) << "), checking it every minute instead\n";
+
+		if(mFd >= 0) {
+			close(mFd);
+			mFd = -1;
+		}
+	}
+
+	statChanged();
+	mHashValid = hashFile(mHash);
+}
+
+FileWatcher::~FileWatcher() {
+	if(mFd >= 0) {
+		close(mFd);
+	}
+}
+
+bool FileWatcher::changed() {
+	// Both are checked, so that a missed event (or a full queue) is still caught on the next call.
+	bool events = readEvents();
+	bool stat = statChanged();
+	if(!events && !stat) {
+		return false;
+	}
+
+	// A file that is missing now is picked up again once it is written.
+	uint64_t hash;
+	if(!hashFile(hash)) {
+		return false;
+	}
+
+	if(mHashValid && hash == mHash) {
+		return false;
+	}
+
+	mHash = hash;
+	mHashValid = true;
+	return true;
+}
+
+bool FileWatcher::readEvents() {
+	if(mFd < 0) {
+		return false;
+	}
+
+	bool found = false;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(true) {
+		ssize_t length = read(mFd, buf, sizeof(buf));
+		if(length <= 0) {
+			break;
+		}
+
+		for(char* ptr = buf; ptr < buf + length;) {
+			const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(ptr);
+			if((event->mask & IN_Q_OVERFLOW) != 0 || (event->len > 0 && mName == event->name)) {
+				found = true;
+			}
+
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return found;
+}
+
+bool FileWatcher::statChanged() {
+	struct stat st;
+	if(stat(mPath.c_str(), &st) != 0) {
+		return false;
+	}
+
+	bool changed = st.st_mtim.tv_sec != mMtime || st.st_mtim.tv_nsec != mMtimeNsec
+		|| st.st_size != mSize || st.st_ino != mInode;
+
+	mMtime = st.st_mtim.tv_sec;
+	mMtimeNsec = st.st_mtim.tv_nsec;
+	mSize = st.st_size;
+	mInode = st.st_ino;
+
+	return changed;
+}
+
+bool FileWatcher::hashFile(uint64_t& hash) const {
+	int fd = open(mPath.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	hash = sHashBasis;
+	if(st.st_size > 0) {
+		void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+
+		hash = hashBytes(static_cast<const char*>(data), st.st_size);
+		munmap(data, st.st_size);
+	}
+
+	close(fd);
+	return true;
+}